@@ -0,0 +1,143 @@
+#!/bin/bash
+# End-to-end benchmark of the serial port protocol.
+#
+# For every combination of file size, baud rate, frame size, bit error rate
+# and propagation delay, starts a private cable (its own ports, seed 1) and
+# both endpoints, transfers a file and records one CSV row:
+#   size,baud,frame,ber,delay_ms,ok,wall_s,goodput_Bps,efficiency,wire_bytes,retransmissions,cpu_tx_ms,cpu_rx_ms
+# efficiency is goodput over the line rate, empty without a baud limit.
+# wire_bytes counts both directions, frames and their acknowledgements.
+# With a baseline CSV, rows whose goodput drops or CPU time grows by more
+# than the thresholds are reported as regressions.
+#
+# Environment (lists are space separated):
+#   SIZES, BAUDS (0: no limit), FRAMES (payload bytes), BERS, DELAYS (ms)
+#   OUT       CSV to write (default bench/results.csv)
+#   BASELINE  CSV to compare with (default bench/baseline.csv, if present)
+#   GOODPUT_DROP, CPU_GROWTH  regression thresholds in percent (10, 25)
+#   MIN_CPU   baseline CPU time in ms below which CPU is too noisy to compare (20)
+#   TIMEOUT   seconds before a transfer counts as failed (120)
+
+cd "$(dirname "$0")/.." || exit 1
+
+SIZES=${SIZES:-"16384 131072"}
+BAUDS=${BAUDS:-"0 230400"}
+FRAMES=${FRAMES:-"1020 256"}
+BERS=${BERS:-"0 1e-5"}
+DELAYS=${DELAYS:-"0 2"}
+OUT=${OUT:-bench/results.csv}
+BASELINE=${BASELINE:-bench/baseline.csv}
+GOODPUT_DROP=${GOODPUT_DROP:-10}
+CPU_GROWTH=${CPU_GROWTH:-25}
+MIN_CPU=${MIN_CPU:-20}
+TIMEOUT=${TIMEOUT:-120}
+
+WORK=$(mktemp -d /tmp/bench.XXXXXX)
+trap 'pkill -TERM -P $$ 2>/dev/null; rm -rf "$WORK"' EXIT
+
+# Same pseudo-random contents on every run, so stuffing costs the same
+makeFile()
+{
+    openssl enc -aes-128-ctr -nosalt -pass pass:bench -pbkdf2 < /dev/zero 2>/dev/null | head -c "$1" > "$2"
+}
+
+nowNs()
+{
+    date +%s%N
+}
+
+# Run one transfer and print its CSV row
+runOne()
+{
+    local size=$1 baud=$2 frame=$3 ber=$4 delay=$5
+    local dir="$WORK/run"
+    rm -rf "$dir" && mkdir -p "$dir"
+
+    CABLE_PREFIX="$dir/tty" ./bin/cable "summary 0" "metrics $dir/metrics.json" "seed 1" \
+        "baud $baud" "ber $ber" "delay $delay" < /dev/null > "$dir/cable.log" 2>&1 &
+    local cable=$!
+    while ! grep -q "Cable ready" "$dir/cable.log" 2>/dev/null; do
+        kill -0 $cable 2>/dev/null || { echo "cable failed" >&2; return 1; }
+        sleep 0.01
+    done
+
+    # The receiver flushes its port while setting it up, so the transmitter
+    # starts only once that is done, or its SET could be lost. Line buffered
+    # output makes the receiver's first line show up when it is printed.
+    timeout "$TIMEOUT" stdbuf -oL ./bin/main "$dir/tty11" rx "$dir/out.bin" > "$dir/rx.log" 2>&1 &
+    local rx=$!
+    while ! grep -q "Set new TermIOs struct" "$dir/rx.log" 2>/dev/null; do
+        kill -0 $rx 2>/dev/null || break
+        sleep 0.001
+    done
+
+    local start=$(nowNs)
+    APP_FRAME_SIZE=$frame timeout "$TIMEOUT" ./bin/main "$dir/tty10" tx "$WORK/file.$size" > "$dir/tx.log" 2>&1
+    wait $rx
+    local end=$(nowNs)
+
+    kill -TERM $cable
+    wait $cable
+
+    local ok=0
+    cmp -s "$WORK/file.$size" "$dir/out.bin" && ok=1
+
+    local wireBytes=$(grep -o '"bytes_in": [0-9]*' "$dir/metrics.json" | awk '{ sum += $2 } END { print sum + 0 }')
+    local retransmissions=$(sed -n 's/^I-frames: .* \([0-9]*\) retransmissions$/\1/p' "$dir/tx.log")
+    local cpuTx=$(sed -n 's/^CPU: \([0-9.]*\) ms.*/\1/p' "$dir/tx.log")
+    local cpuRx=$(sed -n 's/^CPU: \([0-9.]*\) ms.*/\1/p' "$dir/rx.log")
+
+    awk -v size=$size -v baud=$baud -v frame=$frame -v ber=$ber -v delay=$delay -v ok=$ok \
+        -v ns=$((end - start)) -v wire=${wireBytes:-0} -v retx=${retransmissions:-0} \
+        -v cpuTx=${cpuTx:-0} -v cpuRx=${cpuRx:-0} 'BEGIN {
+        wall = ns / 1e9
+        goodput = ok ? size / wall : 0
+        efficiency = baud > 0 ? sprintf("%.3f", goodput / (baud / 10)) : ""
+        printf "%d,%d,%d,%s,%s,%d,%.3f,%.0f,%s,%d,%d,%.1f,%.1f\n",
+               size, baud, frame, ber, delay, ok, wall, goodput, efficiency, wire, retx, cpuTx, cpuRx
+    }'
+}
+
+make -s all || exit 1
+
+echo "size,baud,frame,ber,delay_ms,ok,wall_s,goodput_Bps,efficiency,wire_bytes,retransmissions,cpu_tx_ms,cpu_rx_ms" > "$OUT"
+for size in $SIZES; do
+    makeFile "$size" "$WORK/file.$size"
+    for baud in $BAUDS; do
+        for frame in $FRAMES; do
+            for ber in $BERS; do
+                for delay in $DELAYS; do
+                    row=$(runOne "$size" "$baud" "$frame" "$ber" "$delay")
+                    echo "$row" | tee -a "$OUT"
+                done
+            done
+        done
+    done
+done
+echo "Results in $OUT"
+
+[ -f "$BASELINE" ] || exit 0
+
+# Match rows on their configuration (first five columns)
+awk -F, -v drop=$GOODPUT_DROP -v growth=$CPU_GROWTH -v minCpu=$MIN_CPU '
+FNR == 1 { next }
+NR == FNR { base[$1","$2","$3","$4","$5] = $0; next }
+{
+    key = $1","$2","$3","$4","$5
+    if (!(key in base)) { added++; next }
+    split(base[key], b, ",")
+    compared++
+    if ($6 == 0 && b[6] == 1)
+        { print "REGRESSION " key ": transfer failed"; regressions++; next }
+    if (b[8] > 0 && $8 < b[8] * (1 - drop / 100))
+        { printf "REGRESSION %s: goodput %d B/s, baseline %d B/s (%+.1f%%)\n", key, $8, b[8], 100 * ($8 / b[8] - 1); regressions++ }
+    cpu = $12 + $13; baseCpu = b[12] + b[13]
+    if (baseCpu >= minCpu && cpu > baseCpu * (1 + growth / 100))
+        { printf "REGRESSION %s: CPU %.1f ms, baseline %.1f ms (%+.1f%%)\n", key, cpu, baseCpu, 100 * (cpu / baseCpu - 1); regressions++ }
+}
+END {
+    printf "Compared %d configurations with the baseline: %d regressions", compared, regressions
+    if (added) printf ", %d new", added
+    printf "\n"
+    exit regressions > 0
+}' "$BASELINE" "$OUT"
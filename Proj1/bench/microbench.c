@@ -0,0 +1,207 @@
+// Microbenchmarks of the link layer functions that run per byte or per frame.
+//
+// The link layer source is compiled into this program, so the step functions,
+// their state type and buildIFrame are reachable without exporting them. Each
+// function runs in a timing loop over one payload kind at a time:
+//   random   uniform bytes, about 2 in 256 escaped
+//   flags    all 0x7E, every byte escaped
+//   text     ASCII text, nothing escaped
+// and prints ns per frame, ns per byte and TSC cycles per byte.
+//
+// Usage: microbench [payload bytes] [ms per measurement]
+
+#include "../src/link_layer.c"
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#define PAYLOAD_KINDS 3
+
+static const char *payloadNames[PAYLOAD_KINDS] = {"random", "flags", "text"};
+
+static int payloadSize = MAX_PAYLOAD_SIZE;
+static long long measureNs = 200 * 1000000LL;
+
+static unsigned char payload[MAX_PAYLOAD_SIZE];
+static unsigned char frame[2 * MAX_PAYLOAD_SIZE + 8];
+static unsigned char packet[2 * MAX_PAYLOAD_SIZE + 8];
+static unsigned int frameSize;
+static int pipeFds[2];
+
+// Results are folded in here so the loops are not optimized away
+static volatile unsigned long long sink;
+
+static long long nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void fillPayload(int kind)
+{
+    static const char text[] = "The quick brown fox jumps over the lazy dog. "
+                               "Pack my box with five dozen liquor jugs.\n";
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+
+    for (int i = 0; i < payloadSize; i++)
+    {
+        if (kind == 0)
+        {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            payload[i] = x >> 24;
+        }
+        else if (kind == 1)
+            payload[i] = FLAG;
+        else
+            payload[i] = text[i % (sizeof(text) - 1)];
+    }
+    frameSize = buildIFrame(frame, 0, payload, payloadSize, NULL, 0);
+}
+
+// One frame's worth of work for each benchmark. Return a value for the sink.
+
+static unsigned int runStuff(void)
+{
+    unsigned char BCC2 = 0;
+    return stuffBytes(packet, payload, payloadSize, &BCC2) + BCC2;
+}
+
+static unsigned int runBuild(void)
+{
+    return buildIFrame(packet, 0, payload, payloadSize, NULL, 0);
+}
+
+// A fresh copy of the frame goes into the pipe before each call; the timing
+// includes receiveData's read() calls, one per byte by default as on the
+// serial port
+static unsigned int runReceive(void)
+{
+    size_t size = 0;
+    if (write(pipeFds[1], frame, frameSize) != frameSize)
+        return 0;
+    fd = pipeFds[0];
+    if (receiveData(packet, 0, &size) != TRUE || size != (size_t)payloadSize)
+    {
+        fprintf(stderr, "receiveData rejected a valid frame\n");
+        exit(1);
+    }
+    return size;
+}
+
+// Supervision frames the step functions accept, fed back to back
+static const unsigned char uaFrame[] = {FLAG, A, C_UA, BCC(A, C_UA), FLAG};
+static const unsigned char rrFrame[] = {FLAG, A, ACK(1), BCC(A, ACK(1)), FLAG};
+static const unsigned char discFrame[] = {FLAG, A, C_DISC, BCC(A, C_DISC), FLAG};
+
+static unsigned int runState(void)
+{
+    stateMachine s = START;
+    for (int i = 0; i < SIZE_UA; i++)
+        stateDetermine(&s, uaFrame[i], TRUE);
+    return s == DONE;
+}
+
+static unsigned int runACK(void)
+{
+    stateMachine s = START;
+    unsigned char ack = 0;
+    for (int i = 0; i < SIZE_UA; i++)
+        receiveACK(&s, rrFrame[i], &ack, 1);
+    return s == DONE && ack == ACK(1);
+}
+
+static unsigned int runDISC(void)
+{
+    stateMachine s = START;
+    for (int i = 0; i < SIZE_UA; i++)
+        DISCStateDetermine(&s, discFrame[i]);
+    return s == DONE;
+}
+
+// Run "step" in batches until measureNs has passed and print one row.
+// "bytes" is the number of bytes one step handles.
+static void measure(const char *name, const char *kind, unsigned int (*step)(void), int bytes)
+{
+    long long frames = 0, batch = 1, elapsed = 0;
+    uint64_t ticks = 0;
+
+    // Warm up caches and the branch predictor
+    for (int i = 0; i < 100; i++)
+        sink += step();
+
+    while (elapsed < measureNs)
+    {
+        long long start = nowNs();
+        uint64_t startTicks = cycles();
+        for (long long i = 0; i < batch; i++)
+            sink += step();
+        ticks += cycles() - startTicks;
+        elapsed += nowNs() - start;
+        frames += batch;
+        if (batch < 1 << 20)
+            batch *= 2;
+    }
+
+    double perFrame = (double)elapsed / frames;
+    printf("%-20s %-7s %6d %12.1f %9.2f", name, kind, bytes, perFrame, perFrame / bytes);
+    if (HAVE_TSC)
+        printf(" %12.2f\n", (double)ticks / frames / bytes);
+    else
+        printf(" %12s\n", "-");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        payloadSize = atoi(argv[1]);
+    if (argc > 2)
+        measureNs = atoll(argv[2]) * 1000000LL;
+    if (payloadSize < 1 || payloadSize > MAX_PAYLOAD_SIZE || measureNs <= 0)
+    {
+        printf("Usage: %s [payload bytes, 1 to %d] [ms per measurement]\n", argv[0], MAX_PAYLOAD_SIZE);
+        return 1;
+    }
+    if (pipe(pipeFds) != 0)
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    printf("%-20s %-7s %6s %12s %9s %12s\n", "function", "payload", "bytes", "ns/frame", "ns/byte",
+           HAVE_TSC ? "cycles/byte" : "");
+
+    for (int kind = 0; kind < PAYLOAD_KINDS; kind++)
+    {
+        fillPayload(kind);
+        measure("stuffBytes+BCC2", payloadNames[kind], runStuff, payloadSize);
+        measure("buildIFrame", payloadNames[kind], runBuild, payloadSize);
+        measure("receiveData", payloadNames[kind], runReceive, payloadSize);
+        readChunk = READ_BUFFER_SIZE; // As with LL_READ_PROFILE set
+        measure("receiveData, 4 KB", payloadNames[kind], runReceive, payloadSize);
+        readChunk = 1;
+    }
+    measure("stateDetermine", "UA", runState, SIZE_UA);
+    measure("receiveACK", "RR", runACK, SIZE_UA);
+    measure("DISCStateDetermine", "DISC", runDISC, SIZE_UA);
+
+    if (HAVE_TSC)
+        printf("Cycles are TSC ticks, which run at the nominal clock rather than the current one.\n");
+    return 0;
+}
@@ -0,0 +1,366 @@
+// Benchmark of termios read strategies over a pty pair.
+//
+// Grown from the TPs programs (read_canonical.c, read_noncanonical.c and the
+// matching writers): each of those sets up the port in one way. Here the
+// reading end of a pty takes every configuration in turn while a writer
+// thread feeds the other end, and two things are measured:
+//   latency     a 5-byte supervision frame written, time until all of it is read
+//   throughput  a stream of 1 KB chunks (about one stuffed I-frame each),
+//               with the read() calls and reader CPU time it took
+//   signal      on a silent line, time from a SIGALRM (installed with
+//               signal(), as the link layer does) until the read returns
+// Strategies marked "bounded" return within VTIME/the poll timeout when the
+// line is silent, which the link layer needs to notice its alarms; llopen
+// only picks from those, see LL_READ_PROFILE in the README.
+//
+// Usage: read_bench [throughput KB] [latency samples] [baud, 0 for unpaced]
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FALSE 0
+#define TRUE 1
+
+#define FLAG 0x7E
+#define CHUNK_SIZE 1024
+#define FRAME_SIZE 5
+#define BUF_SIZE 4096
+#define POLL_TIMEOUT 100 // ms, as VTIME=1
+#define SIGNAL_SAMPLES 5
+
+typedef struct
+{
+    const char *name;
+    int canonical;
+    int vmin, vtime;
+    int poll;     // poll() before every read
+    int nonblock; // O_NONBLOCK
+    int readSize; // Bytes asked from each read()
+    int bounded;  // A silent line cannot block a read forever
+} Strategy;
+
+static const Strategy strategies[] = {
+    {"canonical (lines)", TRUE, 1, 0, FALSE, FALSE, BUF_SIZE, FALSE},
+    {"VMIN=1 VTIME=0, 1 B", FALSE, 1, 0, FALSE, FALSE, 1, FALSE},
+    {"VMIN=0 VTIME=1, 1 B", FALSE, 0, 1, FALSE, FALSE, 1, TRUE},
+    {"VMIN=0 VTIME=1, 4 KB", FALSE, 0, 1, FALSE, FALSE, BUF_SIZE, TRUE},
+    {"VMIN=64 VTIME=1, 4 KB", FALSE, 64, 1, FALSE, FALSE, BUF_SIZE, FALSE},
+    {"O_NONBLOCK+poll, 1 B", FALSE, 0, 0, TRUE, TRUE, 1, TRUE},
+    {"O_NONBLOCK+poll, 4 KB", FALSE, 0, 0, TRUE, TRUE, BUF_SIZE, TRUE},
+    // Reads as O_NONBLOCK does, but leaves writes blocking
+    {"VMIN=0 VTIME=0+poll, 4 KB", FALSE, 0, 0, TRUE, FALSE, BUF_SIZE, TRUE},
+};
+
+#define STRATEGIES (int)(sizeof(strategies) / sizeof(strategies[0]))
+
+typedef struct
+{
+    double p50, p99;   // Latency, ms
+    double mbps;       // Throughput, MB/s
+    double readsPerKB; // read() calls per KB
+    double cpuMs;      // Reader CPU time for the stream
+    double signalMs;   // Read return after a signal, bounded strategies only
+} Result;
+
+static int throughputKB = 1024;
+static int latencySamples = 200;
+static int baudRate = 0;
+
+static int master = -1;
+static int handshake[2]; // Reader to writer: the latency frame was read
+static const Strategy *current;
+static volatile long long signalNs;
+
+static long long nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static double threadCpuMs(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+}
+
+// Open a pty pair and configure the slave end for the strategy, as the TPs
+// programs configure the serial port. Return the reading fd.
+static int openPair(const Strategy *strategy)
+{
+    struct termios newtio;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        perror("posix_openpt");
+        exit(-1);
+    }
+
+    int fd = open(ptsname(master), O_RDWR | O_NOCTTY | (strategy->nonblock ? O_NONBLOCK : 0));
+    if (fd < 0)
+    {
+        perror(ptsname(master));
+        exit(-1);
+    }
+
+    // Clear struct for new port settings
+    memset(&newtio, 0, sizeof(newtio));
+
+    newtio.c_cflag = B38400 | CS8 | CLOCAL | CREAD;
+    newtio.c_iflag = IGNPAR;
+    newtio.c_oflag = 0;
+
+    // Canonical input delivers whole lines. Every control character is
+    // disabled, Ctrl-d too unlike read_canonical.c: it is the BCC of a UA.
+    newtio.c_lflag = strategy->canonical ? ICANON : 0;
+    newtio.c_cc[VTIME] = strategy->vtime;
+    newtio.c_cc[VMIN] = strategy->vmin;
+
+    tcflush(fd, TCIOFLUSH);
+    if (tcsetattr(fd, TCSANOW, &newtio) == -1)
+    {
+        perror("tcsetattr");
+        exit(-1);
+    }
+
+    // Termios calls on the master act on the slave too, so the writing end
+    // is left alone
+    return fd;
+}
+
+// One read() as the strategy does it. Return the bytes read, 0 on a timeout.
+static int readSome(int fd, unsigned char *buf, long long *reads)
+{
+    if (current->poll)
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, POLL_TIMEOUT) <= 0)
+            return 0;
+    }
+    (*reads)++;
+    int n = read(fd, buf, current->readSize);
+    return n > 0 ? n : 0;
+}
+
+static void writeAll(const unsigned char *buf, int size)
+{
+    while (size > 0)
+    {
+        int n = write(master, buf, size);
+        if (n <= 0)
+            return;
+        buf += n;
+        size -= n;
+    }
+}
+
+// Writer of the latency test: one frame at a time, each after the reader
+// reported the previous one
+static void *latencyWriter(void *arg)
+{
+    long long *sentNs = arg;
+    unsigned char frame[FRAME_SIZE] = {FLAG, 0x03, 0x07, 0x03 ^ 0x07, FLAG};
+    char done;
+
+    if (current->canonical)
+        frame[FRAME_SIZE - 1] = '\n';
+
+    for (int i = 0; i < latencySamples; i++)
+    {
+        usleep(200); // Let the reader go back to sleep in read()
+        sentNs[i] = nowNs();
+        writeAll(frame, FRAME_SIZE);
+        if (read(handshake[0], &done, 1) != 1)
+            break;
+    }
+    return NULL;
+}
+
+// Writer of the throughput test. With a baud rate, chunks are paced as a
+// serial line would deliver them (10 bits per byte).
+static void *streamWriter(void *arg)
+{
+    unsigned char chunk[CHUNK_SIZE];
+    for (int i = 0; i < CHUNK_SIZE; i++)
+        chunk[i] = current->canonical ? 'a' + i % 26 : i * 37;
+    if (current->canonical)
+        chunk[CHUNK_SIZE - 1] = '\n';
+
+    long long start = nowNs();
+    long long nsPerChunk = baudRate > 0 ? CHUNK_SIZE * 10 * 1000000000LL / baudRate : 0;
+
+    for (int i = 0; i < throughputKB; i++)
+    {
+        if (nsPerChunk > 0)
+        {
+            long long wait = start + i * nsPerChunk - nowNs();
+            if (wait > 0)
+                usleep(wait / 1000);
+        }
+        writeAll(chunk, CHUNK_SIZE);
+    }
+    return NULL;
+}
+
+static void alarmHandler(int signal)
+{
+    signalNs = nowNs();
+}
+
+// Average delay between SIGALRM and the end of the read it interrupted
+static void measureSignal(int fd, Result *result)
+{
+    unsigned char buf[BUF_SIZE];
+    long long reads = 0, total = 0;
+    struct itimerval timer = {.it_value = {.tv_usec = 20000}};
+
+    // signal() restarts interrupted reads, only poll() returns early
+    (void)signal(SIGALRM, alarmHandler);
+    for (int i = 0; i < SIGNAL_SAMPLES; i++)
+    {
+        signalNs = 0;
+        setitimer(ITIMER_REAL, &timer, NULL);
+        while (signalNs == 0)
+            readSome(fd, buf, &reads);
+        total += nowNs() - signalNs;
+    }
+    result->signalMs = total / 1e6 / SIGNAL_SAMPLES;
+}
+
+static int compareLongLong(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void measureLatency(int fd, Result *result)
+{
+    long long *sentNs = calloc(latencySamples, sizeof(long long));
+    long long *latency = calloc(latencySamples, sizeof(long long));
+    unsigned char buf[BUF_SIZE];
+    long long reads = 0;
+    pthread_t writer;
+
+    pthread_create(&writer, NULL, latencyWriter, sentNs);
+    for (int i = 0; i < latencySamples; i++)
+    {
+        int got = 0;
+        while (got < FRAME_SIZE)
+            got += readSome(fd, buf, &reads);
+        latency[i] = nowNs() - sentNs[i];
+        if (write(handshake[1], "", 1) != 1)
+            break;
+    }
+    pthread_join(writer, NULL);
+
+    qsort(latency, latencySamples, sizeof(long long), compareLongLong);
+    result->p50 = latency[latencySamples / 2] / 1e6;
+    result->p99 = latency[latencySamples * 99 / 100] / 1e6;
+    free(sentNs);
+    free(latency);
+}
+
+static void measureThroughput(int fd, Result *result)
+{
+    unsigned char buf[BUF_SIZE];
+    long long total = (long long)throughputKB * CHUNK_SIZE, got = 0, reads = 0;
+    pthread_t writer;
+
+    double cpuStart = threadCpuMs();
+    long long start = nowNs();
+    pthread_create(&writer, NULL, streamWriter, NULL);
+    while (got < total)
+        got += readSome(fd, buf, &reads);
+    long long elapsed = nowNs() - start;
+    pthread_join(writer, NULL);
+
+    result->mbps = total / (elapsed / 1e9) / 1e6;
+    result->readsPerKB = (double)reads / throughputKB;
+    result->cpuMs = threadCpuMs() - cpuStart;
+}
+
+int main(int argc, char *argv[])
+{
+    Result results[STRATEGIES];
+
+    if (argc > 1)
+        throughputKB = atoi(argv[1]);
+    if (argc > 2)
+        latencySamples = atoi(argv[2]);
+    if (argc > 3)
+        baudRate = atoi(argv[3]);
+    if (throughputKB < 1 || latencySamples < 1 || baudRate < 0)
+    {
+        printf("Usage: %s [throughput KB] [latency samples] [baud, 0 for unpaced]\n", argv[0]);
+        return 1;
+    }
+    if (pipe(handshake) != 0)
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    printf("%-26s %7s %9s %9s %9s %9s %9s %9s\n", "strategy", "bounded", "p50 ms", "p99 ms", "MB/s",
+           "reads/KB", "CPU ms", "signal ms");
+
+    for (int i = 0; i < STRATEGIES; i++)
+    {
+        current = &strategies[i];
+        int fd = openPair(current);
+        measureLatency(fd, &results[i]);
+        measureThroughput(fd, &results[i]);
+        if (current->bounded)
+            measureSignal(fd, &results[i]);
+        close(fd);
+        close(master);
+
+        printf("%-26s %7s %9.3f %9.3f %9.3f %9.2f %9.1f", current->name, current->bounded ? "yes" : "no",
+               results[i].p50, results[i].p99, results[i].mbps, results[i].readsPerKB, results[i].cpuMs);
+        if (current->bounded)
+            printf(" %9.3f\n", results[i].signalMs);
+        else
+            printf(" %9s\n", "-");
+        fflush(stdout);
+    }
+
+    // Best bounded, binary-safe strategy for each profile. Latency counts
+    // both waits: for a frame and, on a lost one, for the retransmission
+    // alarm. Throughputs within 5% of the best count as equal and the
+    // cheaper one wins.
+    int latency = -1, throughput = -1;
+    double bestMbps = 0;
+    for (int i = 0; i < STRATEGIES; i++)
+    {
+        if (!strategies[i].bounded || strategies[i].canonical)
+            continue;
+        if (latency < 0 ||
+            results[i].p50 + results[i].signalMs < results[latency].p50 + results[latency].signalMs)
+            latency = i;
+        if (results[i].mbps > bestMbps)
+            bestMbps = results[i].mbps;
+    }
+    for (int i = 0; i < STRATEGIES; i++)
+    {
+        if (!strategies[i].bounded || strategies[i].canonical || results[i].mbps < bestMbps * 0.95)
+            continue;
+        if (throughput < 0 || results[i].cpuMs < results[throughput].cpuMs)
+            throughput = i;
+    }
+    printf("Best for latency: %s\n", strategies[latency].name);
+    printf("Best for throughput: %s\n", strategies[throughput].name);
+    return 0;
+}
@@ -1,16 +1,38 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates a pair of virtual Tx / Rx serial ports as pseudo-terminals.
+//
+// Forwarding is event driven: one epoll loop waits on both ports and stdin,
+// and each direction buffers what the far end cannot take yet, so the cable
+// itself adds only microseconds. That added latency is measured per chunk,
+// from the read() that brought it in to the write() that passed it on.
+//
+// Each direction can also impair the line: bit errors, Gilbert-Elliott error
+// bursts, frame drops and duplicates, propagation delay with jitter and a
+// baud rate limit. Random choices come from a seeded generator per direction
+// and impairment, and errors are drawn per byte of the stream, so the same
+// seed and traffic give the same errors whatever the chunking.
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 
+// For posix_openpt() and cfmakeraw()
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 // Baudrate settings are defined in <asm/termbits.h>, which is
@@ -20,7 +42,24 @@
 #define FALSE 0
 #define TRUE 1
 
-#define BUF_SIZE 2048
+#define BUF_SIZE 65536       // Largest single read
+#define MAX_FRAME 8192       // Longest frame kept for duplication
+#define LINE_BATCH 64        // Bytes a baud-limited line releases per wakeup, at most
+#define PIPE_SIZE (1 << 20)  // Bytes a direction holds while the far end is slow
+#define MAX_STAMPS 4096      // Chunks whose added latency is still being measured
+#define LATENCY_BUCKETS 32   // Powers of two in nanoseconds
+#define MAX_EVENTS 16
+#define MAX_LINKS 16         // Links of a topology
+#define MAX_PORTS (2 * MAX_LINKS)
+
+#define PCAPNG_SHB 0x0A0D0D0A   // Section header block
+#define PCAPNG_IDB 1            // Interface description block
+#define PCAPNG_EPB 6            // Enhanced packet block
+#define LINKTYPE_USER0 147      // Link type for private use
+#define DISSECT_FRAME 4096      // Longest frame the dissector decodes whole
+#define MAX_TIMELINE 256     // Pending scenario events
+#define COMMAND_SIZE 128
+#define UNDO_COMMANDS 6      // Undo commands "clear" leaves per direction
 
 typedef enum
 {
@@ -29,31 +68,149 @@ typedef enum
     CableModeNoise,
 } CableMode;
 
-// Returns: serial port file descriptor (fd).
-int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
+// Added latency, from a chunk's read() to the write() of its last byte
+typedef struct
 {
-    int fd = open(serialPort, O_RDWR | O_NOCTTY);
+    unsigned long long count;
+    uint64_t totalNs;
+    uint64_t minNs;
+    uint64_t maxNs;
+    unsigned long long buckets[LATENCY_BUCKETS];
+} Latency;
 
-    if (fd < 0)
+// Where a chunk ends in the byte stream of its direction, when it was read
+// and when it may leave (after the propagation delay)
+typedef struct
+{
+    unsigned long long end;
+    uint64_t readNs;
+    uint64_t releaseNs;
+} Stamp;
+
+// Line impairments of one direction. Probabilities are per byte for the
+// burst state changes, per bit for errors and per frame for drops and
+// duplicates.
+typedef struct
+{
+    double ber;        // Independent bit error rate
+    double burstEnter; // Gilbert-Elliott: chance to enter the bad state...
+    double burstLeave; // ...and to leave it again
+    double burstBer;   // Bit error rate while in the bad state
+    double drop;       // Chance to lose a frame
+    double duplicate;  // Chance to deliver a frame twice
+    uint64_t delayNs;  // Propagation delay...
+    uint64_t jitterNs; // ...plus up to this much more, order kept
+    int baud;          // Line rate with 10 bits per byte (8N1), 0 for no limit
+} Impairments;
+
+// Frames the dissector tells apart
+enum
+{
+    FrameSet,
+    FrameUa,
+    FrameI,
+    FrameRr,
+    FrameRej,
+    FrameDisc,
+    FrameOther,
+    FrameBad,
+    FRAME_KINDS
+};
+
+// Random generators of one direction, one per impairment so that changing
+// one setting does not shift the choices of the others
+enum
+{
+    RngErrors,
+    RngBurst,
+    RngFrames,
+    RngJitter,
+    RNG_COUNT
+};
+
+// One direction of the cable: bytes read from "from" wait in "pipe" until
+// "to" takes them
+typedef struct
+{
+    char name[32];
+    int index; // In "directions"
+    int from;
+    int to;
+
+    unsigned char pipe[PIPE_SIZE];
+    size_t start; // First byte not written yet
+    size_t end;   // One past the last byte read
+
+    unsigned long long bytesIn;
+    unsigned long long bytesOut;
+    unsigned long long chunks;
+    unsigned long long bytesDropped;   // Lost while off or with dropped frames
+    unsigned long long bytesCorrupted; // Hit by at least one bit error
+    unsigned long long bytesDelayed;   // Held back by the propagation delay
+    size_t maxDepth;                   // Most bytes waiting in the pipe
+
+    Stamp stamps[MAX_STAMPS];
+    int stampHead;
+    int stampCount;
+    int stampReleased;    // Stamps from the head whose release time passed
+    uint64_t lastRelease; // Release time of the newest chunk
+    uint64_t lineFreeNs;  // When a baud-limited line can send its next byte
+    Latency latency;
+
+    Impairments impairments;
+    uint64_t rng[RNG_COUNT];
+    int burstBad;       // Gilbert-Elliott state
+    int inFrame;        // Between an opening flag and a closing one
+    int dropFrame;      // The current frame is being dropped
+    int frameSize;      // Bytes of the current frame so far, flags included
+    unsigned char frame[MAX_FRAME];
+
+    unsigned long long bitErrors;
+    unsigned long long framesDropped;
+    unsigned long long framesDuplicated;
+
+    // Throughput over the last summary interval
+    unsigned long long sampleBytes;
+    uint64_t sampleNs;
+    double throughput; // Bytes per second written to "to"
+} Direction;
+
+// Create a pseudo-terminal whose slave end is reachable at "link", like a
+// serial port. The slave is left in raw mode and kept open, so the master
+// neither echoes nor reports a hangup while no program has the port open.
+// Returns: master file descriptor, or -1 on error.
+int openPty(const char *link, int *slaveFd)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (master < 0)
         return -1;
 
-    // Save current port settings
-    if (tcgetattr(fd, oldtio) == -1)
+    const char *slaveName = (grantpt(master) == 0 && unlockpt(master) == 0) ? ptsname(master) : NULL;
+    int slave = (slaveName != NULL) ? open(slaveName, O_RDWR | O_NOCTTY) : -1;
+    if (slave < 0)
+    {
+        close(master);
         return -1;
+    }
 
-    memset(newtio, 0, sizeof(*newtio));
-    newtio->c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio->c_iflag = IGNPAR;
-    newtio->c_oflag = 0;
-    newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 1; // Inter-character timer unused
-    newtio->c_cc[VMIN] = 0;  // Read without blocking
-    tcflush(fd, TCIOFLUSH);
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tio.c_cflag |= BAUDRATE | CLOCAL | CREAD;
+    tcsetattr(slave, TCSANOW, &tio);
+    chmod(slaveName, 0666);
 
-    if (tcsetattr(fd, TCSANOW, newtio) == -1)
+    // Replace whatever the link pointed to, a previous cable's pty included
+    unlink(link);
+    if (symlink(slaveName, link) != 0)
+    {
+        close(slave);
+        close(master);
         return -1;
+    }
 
-    return fd;
+    *slaveFd = slave;
+    return master;
 }
 
 // Add noise to a buffer, by flipping the byte in the "errorIndex" position.
@@ -62,154 +219,1541 @@ void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
     buf[errorIndex] ^= 0xFF;
 }
 
-int main(int argc, char *argv[])
+// splitmix64: small, fast and good enough to emulate a line
+uint64_t nextRandom(uint64_t *state)
 {
-    printf("\n");
-
-    system("socat -dd PTY,link=/dev/ttyS10,mode=777 PTY,link=/dev/emulatorTx,mode=777 &");
-    sleep(1);
-    printf("\n");
-
-    system("socat -dd PTY,link=/dev/ttyS11,mode=777 PTY,link=/dev/emulatorRx,mode=777 &");
-    sleep(1);
-
-    printf("\n\n"
-           "Transmitter must open /dev/ttyS10\n"
-           "Receiver must open /dev/ttyS11\n"
-           "\n"
-           "The cable program is sensible to the following interactive commands:\n"
-           "--- on           : connect the cable and data is exchanged (default state)\n"
-           "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- noise        : add fixed noise to the cable\n"
-           "--- end          : terminate the program\n"
-           "\n");
-
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
 
-    int fdTx = openSerialPort("/dev/emulatorTx", &oldtioTx, &newtioTx);
+// Uniform in [0, 1)
+double randomUnit(uint64_t *state)
+{
+    return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
 
-    if (fdTx < 0)
+void seedDirection(Direction *dir, uint64_t seed, int index)
+{
+    for (int i = 0; i < RNG_COUNT; i++)
     {
-        perror("Opening Tx emulator serial port");
-        exit(-1);
+        dir->rng[i] = seed * 1000003 + index * RNG_COUNT + i;
+        nextRandom(&dir->rng[i]);
     }
+}
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
+// Flip bits of a byte, each with probability "ber". Return the flips.
+int corruptByte(unsigned char *byte, double ber, uint64_t *rng)
+{
+    // Chance that all 8 bits survive, (1 - ber)^8 without libm
+    double clean = 1 - ber;
+    clean *= clean;
+    clean *= clean;
+    clean *= clean;
+    if (randomUnit(rng) < clean)
+        return 0;
 
-    int fdRx = openSerialPort("/dev/emulatorRx", &oldtioRx, &newtioRx);
+    // At least one bit is hit: pick the first one from its conditional
+    // distribution, then each later bit independently
+    double u = randomUnit(rng) * (1 - clean);
+    double mass = ber;
+    int bit = 0;
+    while (bit < 7 && u >= mass)
+    {
+        u -= mass;
+        mass *= 1 - ber;
+        bit++;
+    }
 
-    if (fdRx < 0)
+    int flips = 1;
+    *byte ^= 1 << bit;
+    for (bit++; bit < 8; bit++)
     {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
+        if (randomUnit(rng) < ber)
+        {
+            *byte ^= 1 << bit;
+            flips++;
+        }
     }
+    return flips;
+}
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+// Apply independent and burst bit errors to bytes entering the pipe
+void applyErrors(Direction *dir, unsigned char *buf, size_t size)
+{
+    const Impairments *imp = &dir->impairments;
 
-    unsigned char tx2rx[BUF_SIZE] = {0};
-    unsigned char rx2tx[BUF_SIZE] = {0};
-    char rxStdin[BUF_SIZE] = {0};
+    for (size_t i = 0; i < size; i++)
+    {
+        if (imp->burstEnter > 0)
+        {
+            double change = dir->burstBad ? imp->burstLeave : imp->burstEnter;
+            if (randomUnit(&dir->rng[RngBurst]) < change)
+                dir->burstBad = !dir->burstBad;
+        }
+
+        double ber = (dir->burstBad && imp->burstEnter > 0) ? imp->burstBer : imp->ber;
+        if (ber > 0)
+        {
+            int flips = corruptByte(&buf[i], ber, &dir->rng[RngErrors]);
+            dir->bitErrors += flips;
+            dir->bytesCorrupted += (flips > 0);
+        }
+    }
+}
 
-    CableMode cableMode = CableModeOn;
-    volatile int STOP = FALSE;
+// Append bytes read from a port to the pipe, dropping and duplicating whole
+// frames. Frames are told apart by their flags; a dropped frame keeps its
+// flags so the receiver just sees an empty frame. Return the bytes appended.
+size_t appendFrames(Direction *dir, const unsigned char *buf, size_t size)
+{
+    const Impairments *imp = &dir->impairments;
+    unsigned char *out = dir->pipe + dir->end;
+    size_t n = 0;
 
-    printf("Cable ready\n");
+    if (imp->drop <= 0 && imp->duplicate <= 0)
+    {
+        memcpy(out, buf, size);
+        return size;
+    }
 
-    while (STOP == FALSE)
+    for (size_t i = 0; i < size; i++)
     {
-        // Read from Tx
-        int bytesFromTx = read(fdTx, tx2rx, BUF_SIZE);
+        unsigned char byte = buf[i];
 
-        if (bytesFromTx > 0)
+        if (byte != 0x7E)
         {
-            if (cableMode == CableModeOff)
+            // First byte after an opening flag: decide the frame's fate
+            if (!dir->inFrame && dir->frameSize > 0)
             {
-                printf("bytesFromTx=%d > bytesToRx=CONNECTION OFF\n", bytesFromTx);
+                dir->inFrame = TRUE;
+                dir->dropFrame = randomUnit(&dir->rng[RngFrames]) < imp->drop;
+                dir->framesDropped += dir->dropFrame;
             }
+            if (!dir->dropFrame)
+                out[n++] = byte;
             else
-            {
-                if (cableMode == CableModeNoise)
-                {
-                    addNoiseToBuffer(tx2rx, 0);
-                }
+                dir->bytesDropped++;
+            if (dir->inFrame && dir->frameSize < MAX_FRAME)
+                dir->frame[dir->frameSize] = byte;
+            dir->frameSize += dir->inFrame;
+            continue;
+        }
 
-                int bytesToRx = write(fdRx, tx2rx, bytesFromTx);
-                printf("bytesFromTx=%d > bytesToRx=%d\n", bytesFromTx, bytesToRx);
-            }
+        out[n++] = byte;
+
+        // Closing flag, the frame may be delivered once more
+        if (dir->inFrame && !dir->dropFrame && dir->frameSize < MAX_FRAME &&
+            randomUnit(&dir->rng[RngFrames]) < imp->duplicate)
+        {
+            dir->frame[dir->frameSize++] = byte;
+            memcpy(out + n, dir->frame, dir->frameSize);
+            n += dir->frameSize;
+            dir->framesDuplicated++;
         }
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, rx2tx, BUF_SIZE);
+        // Any flag may open the next frame
+        dir->inFrame = FALSE;
+        dir->dropFrame = FALSE;
+        dir->frame[0] = byte;
+        dir->frameSize = 1;
+    }
+    return n;
+}
+
+uint64_t nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void latencyAdd(Latency *latency, uint64_t ns)
+{
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (1ULL << bucket) <= ns)
+        bucket++;
+
+    if (latency->count == 0 || ns < latency->minNs)
+        latency->minNs = ns;
+    if (ns > latency->maxNs)
+        latency->maxNs = ns;
+    latency->count++;
+    latency->totalNs += ns;
+    latency->buckets[bucket]++;
+}
+
+// Upper bound, in microseconds, of the bucket holding the given fraction of
+// samples, capped by the largest sample
+double latencyPercentile(const Latency *latency, double fraction)
+{
+    unsigned long long seen = 0, target = latency->count * fraction;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += latency->buckets[i];
+        if (seen > target)
+            return ((1ULL << i) < latency->maxNs ? (1ULL << i) : latency->maxNs) / 1e3;
+    }
+    return latency->maxNs / 1e3;
+}
+
+void printDirection(const Direction *dir)
+{
+    const Latency *latency = &dir->latency;
+
+    printf("%s: %llu bytes in %llu chunks, %llu dropped, %zu pending (max %zu)\n",
+           dir->name, dir->bytesOut, dir->chunks, dir->bytesDropped, dir->end - dir->start, dir->maxDepth);
+    if (dir->bitErrors > 0 || dir->framesDropped > 0 || dir->framesDuplicated > 0 || dir->bytesDelayed > 0)
+        printf("%s: %llu bit errors in %llu bytes, %llu frames dropped, %llu frames duplicated, %llu bytes delayed\n",
+               dir->name, dir->bitErrors, dir->bytesCorrupted, dir->framesDropped, dir->framesDuplicated,
+               dir->bytesDelayed);
+    if (latency->count > 0)
+        printf("%s: added latency min %.1f us, avg %.1f us, p50 <%.1f us, p99 <%.1f us, max %.1f us\n",
+               dir->name, latency->minNs / 1e3, latency->totalNs / 1e3 / latency->count,
+               latencyPercentile(latency, 0.5), latencyPercentile(latency, 0.99), latency->maxNs / 1e3);
+}
+
+// Wire capture in pcapng: two interfaces per direction, 2i for what the
+// sender wrote and 2i + 1 for what the cable delivered, each chunk one
+// packet of the user-defined link type USER0 with a nanosecond timestamp
+static FILE *captureFile;
+static int64_t captureOffsetNs; // CLOCK_REALTIME minus CLOCK_MONOTONIC
+
+// Write a pcapng block made of "head" followed by "data", padded to 32 bits
+void captureBlock(uint32_t type, const void *head, uint32_t headSize, const void *data, uint32_t dataSize)
+{
+    static const unsigned char padding[4] = {0};
+    uint32_t pad = (4 - (headSize + dataSize) % 4) % 4;
+    uint32_t total = 12 + headSize + dataSize + pad;
+
+    fwrite(&type, 4, 1, captureFile);
+    fwrite(&total, 4, 1, captureFile);
+    fwrite(head, 1, headSize, captureFile);
+    fwrite(data, 1, dataSize, captureFile);
+    fwrite(padding, 1, pad, captureFile);
+    fwrite(&total, 4, 1, captureFile);
+}
+
+// Record a chunk seen on a capture interface
+void captureChunk(int interface, uint64_t now, const unsigned char *data, size_t size)
+{
+    if (captureFile == NULL || size == 0)
+        return;
+
+    uint64_t ts = now + captureOffsetNs;
+    uint32_t packet[5] = {interface, ts >> 32, (uint32_t)ts, size, size};
+    captureBlock(PCAPNG_EPB, packet, sizeof(packet), data, size);
+}
+
+// Bytes the pipe can take from one read, moving what it holds to the front
+// when it runs out of room. 0 while the far end must take some first.
+size_t directionRoom(Direction *dir)
+{
+    if (dir->start == dir->end)
+        dir->start = dir->end = 0;
+    else if (PIPE_SIZE - dir->end < 2 * BUF_SIZE + MAX_FRAME && dir->start > 0)
+    {
+        memmove(dir->pipe, dir->pipe + dir->start, dir->end - dir->start);
+        dir->end -= dir->start;
+        dir->start = 0;
+    }
+
+    // Duplicates may double a chunk, plus the frame it completes
+    size_t space = PIPE_SIZE - dir->end;
+    if (dir->impairments.duplicate > 0)
+        space = (space > MAX_FRAME) ? (space - MAX_FRAME) / 2 : 0;
+    if (dir->stampCount == MAX_STAMPS)
+        return 0;
+    return space < BUF_SIZE ? space : BUF_SIZE;
+}
+
+// Add a chunk read from the direction's port to its pipe, applying the cable
+// mode and the impairments
+void feedDirection(Direction *dir, CableMode cableMode, const unsigned char *chunk, size_t bytes, uint64_t now)
+{
+    const Impairments *imp = &dir->impairments;
+
+    captureChunk(2 * dir->index, now, chunk, bytes);
+
+    if (cableMode == CableModeOff)
+    {
+        dir->bytesDropped += bytes;
+        return;
+    }
+
+    size_t size = appendFrames(dir, chunk, bytes);
+    if (size == 0)
+        return;
+
+    if (cableMode == CableModeNoise)
+    {
+        addNoiseToBuffer(dir->pipe + dir->end, 0);
+        dir->bytesCorrupted++;
+    }
+    applyErrors(dir, dir->pipe + dir->end, size);
+
+    dir->end += size;
+    dir->bytesIn += size;
+    dir->chunks++;
+
+    // The line keeps its order, however the jitter falls
+    uint64_t release = now + imp->delayNs;
+    if (imp->jitterNs > 0)
+        release += randomUnit(&dir->rng[RngJitter]) * imp->jitterNs;
+    if (release < dir->lastRelease)
+        release = dir->lastRelease;
+    dir->lastRelease = release;
+    if (release > now)
+        dir->bytesDelayed += size;
+    if (dir->end - dir->start > dir->maxDepth)
+        dir->maxDepth = dir->end - dir->start;
+
+    Stamp *stamp = &dir->stamps[(dir->stampHead + dir->stampCount++) % MAX_STAMPS];
+    stamp->end = dir->bytesIn;
+    stamp->readNs = now;
+    stamp->releaseNs = release;
+}
+
+const Stamp *stampAt(const Direction *dir, int index)
+{
+    return &dir->stamps[(dir->stampHead + index) % MAX_STAMPS];
+}
+
+// Bytes whose delay passed and that are still in the pipe
+size_t releasedBytes(const Direction *dir)
+{
+    if (dir->stampReleased == 0)
+        return 0;
+    return stampAt(dir, dir->stampReleased - 1)->end - dir->bytesOut;
+}
+
+uint64_t byteTimeNs(const Direction *dir)
+{
+    return 10000000000ULL / dir->impairments.baud;
+}
+
+// Write as much of the pipe as the delay, the line rate and "to" allow
+void writeDirection(Direction *dir)
+{
+    uint64_t now = nowNs();
+
+    while (dir->stampReleased < dir->stampCount && stampAt(dir, dir->stampReleased)->releaseNs <= now)
+        dir->stampReleased++;
+
+    size_t allowed = releasedBytes(dir);
+
+    // A baud-limited line lets out only the bytes it had time to send,
+    // starting when the oldest of them was released
+    if (dir->impairments.baud > 0 && allowed > 0)
+    {
+        if (dir->lineFreeNs < stampAt(dir, 0)->releaseNs)
+            dir->lineFreeNs = stampAt(dir, 0)->releaseNs;
+        size_t sendable = (now > dir->lineFreeNs) ? (now - dir->lineFreeNs) / byteTimeNs(dir) : 0;
+        if (sendable < allowed)
+            allowed = sendable;
+    }
+
+    size_t sent = 0;
+    while (sent < allowed)
+    {
+        int bytes = write(dir->to, dir->pipe + dir->start, allowed - sent);
+        if (bytes <= 0)
+            break;
+        captureChunk(2 * dir->index + 1, now, dir->pipe + dir->start, bytes);
+        dir->start += bytes;
+        dir->bytesOut += bytes;
+        sent += bytes;
+    }
+    if (dir->impairments.baud > 0)
+        dir->lineFreeNs += sent * byteTimeNs(dir);
+
+    // Chunks written in full
+    while (dir->stampCount > 0 && dir->stamps[dir->stampHead].end <= dir->bytesOut)
+    {
+        latencyAdd(&dir->latency, now - dir->stamps[dir->stampHead].readNs);
+        dir->stampHead = (dir->stampHead + 1) % MAX_STAMPS;
+        dir->stampCount--;
+        dir->stampReleased--;
+    }
+}
+
+// When the direction next has something to write, 0 if it waits on nothing
+// but its port
+uint64_t nextWake(const Direction *dir)
+{
+    uint64_t wake = 0;
+    size_t released = releasedBytes(dir);
+
+    if (dir->stampReleased < dir->stampCount)
+        wake = stampAt(dir, dir->stampReleased)->releaseNs;
+
+    if (dir->impairments.baud > 0 && released > 0)
+    {
+        uint64_t line = dir->lineFreeNs + byteTimeNs(dir) * (released < LINE_BATCH ? released : LINE_BATCH);
+        if (wake == 0 || line < wake)
+            wake = line;
+    }
+    return wake;
+}
+
+// The earlier of two wake times, where 0 means none
+uint64_t earliest(uint64_t a, uint64_t b)
+{
+    return (a == 0 || (b != 0 && b < a)) ? b : a;
+}
+
+// Arm the timer for an absolute wake time, or disarm it for 0
+void armTimer(int timerFd, uint64_t wake)
+{
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = wake / 1000000000ULL;
+    spec.it_value.tv_nsec = wake % 1000000000ULL;
+    if (wake != 0 && spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+        spec.it_value.tv_nsec = 1;
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
 
-        if (bytesFromRx > 0)
+void printImpairments(const Direction *dir)
+{
+    const Impairments *imp = &dir->impairments;
+    printf("%s: ber %g, burst %g/%g ber %g, drop %g, dup %g, delay %.3f ms + %.3f ms, baud %d\n",
+           dir->name, imp->ber, imp->burstEnter, imp->burstLeave, imp->burstBer, imp->drop, imp->duplicate,
+           imp->delayNs / 1e6, imp->jitterNs / 1e6, imp->baud);
+}
+
+// Link k carries "Tx > Rx" in direction 2k and "Tx < Rx" in 2k + 1. Each
+// direction is allocated, its pipe is too large for the stack.
+static Direction *directions[2 * MAX_LINKS];
+static int directionCount;
+
+// Links of the ports the programs open, and the slave ends kept open
+static char portLinks[MAX_PORTS][256];
+static int portSlaves[MAX_PORTS];
+static int portCount;
+
+static CableMode cableMode = CableModeOn;
+static volatile sig_atomic_t STOP = FALSE;
+
+// Read everything "fd" has and pass each chunk to every direction leaving
+// from it, as fast as the fullest of them allows
+void readPort(int fd)
+{
+    static unsigned char chunk[BUF_SIZE];
+
+    while (1)
+    {
+        size_t room = BUF_SIZE;
+        for (int i = 0; i < directionCount; i++)
         {
-            if (cableMode == CableModeOff)
+            if (directions[i]->from == fd)
             {
-                printf("bytesToTx=CONNECTION OFF < bytesFromRx=%d\n", bytesFromRx);
+                size_t dirRoom = directionRoom(directions[i]);
+                room = dirRoom < room ? dirRoom : room;
             }
-            else
-            {
-                if (cableMode == CableModeNoise)
-                {
-                    addNoiseToBuffer(rx2tx, 0);
-                }
+        }
+        if (room == 0)
+            return;
 
-                int bytesToTx = write(fdTx, rx2tx, bytesFromRx);
-                printf("bytesToTx=%d < bytesFromRx=%d\n", bytesToTx, bytesFromRx);
-            }
+        int bytes = read(fd, chunk, room);
+        if (bytes <= 0)
+            return;
+        uint64_t now = nowNs();
+
+        for (int i = 0; i < directionCount; i++)
+        {
+            if (directions[i]->from == fd)
+                feedDirection(directions[i], cableMode, chunk, bytes, now);
         }
+    }
+}
+
+// Write every direction that leaves through "fd"
+void writePort(int fd)
+{
+    for (int i = 0; i < directionCount; i++)
+    {
+        if (directions[i]->to == fd)
+            writeDirection(directions[i]);
+    }
+}
 
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
+// Watch "fd" for reading while every direction leaving from it has room,
+// and for writing while a direction into it has released bytes it did not
+// take
+void watchFd(int epfd, int fd)
+{
+    struct epoll_event ev = {.data.fd = fd};
+    int readers = 0, full = FALSE;
+
+    for (int i = 0; i < directionCount; i++)
+    {
+        Direction *dir = directions[i];
+        if (dir->from == fd)
         {
-            rxStdin[fromStdin - 1] = '\0';
+            readers++;
+            full |= (directionRoom(dir) == 0);
+        }
+        if (dir->to == fd && dir->impairments.baud == 0 && releasedBytes(dir) > 0)
+            ev.events |= EPOLLOUT;
+    }
+    if (readers > 0 && !full)
+        ev.events |= EPOLLIN;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
 
-            if (strcmp(rxStdin, "off") == 0 || strcmp(rxStdin, "0") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                cableMode = CableModeOff;
-            }
-            else if (strcmp(rxStdin, "on") == 0 || strcmp(rxStdin, "1") == 0)
-            {
-                printf("CONNECTION ON\n");
-                cableMode = CableModeOn;
-            }
-            else if (strcmp(rxStdin, "noise") == 0 || strcmp(rxStdin, "2") == 0)
-            {
-                printf("CONNECTION NOISE\n");
-                cableMode = CableModeNoise;
-            }
-            else if (strcmp(rxStdin, "end") == 0)
-            {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
-            }
+// Create the port "<prefix><number>". Returns: its master, or -1 on error.
+int addPort(const char *prefix, int number)
+{
+    if (portCount == MAX_PORTS)
+        return -1;
+
+    char *link = portLinks[portCount];
+    snprintf(link, sizeof(portLinks[0]), "%s%d", prefix, number);
+    int fd = openPty(link, &portSlaves[portCount]);
+    if (fd < 0)
+    {
+        perror(link);
+        return -1;
+    }
+    portCount++;
+    return fd;
+}
+
+// Add a link whose "Tx > Rx" direction reads "txFrom" and writes "rxTo",
+// and whose "Tx < Rx" direction reads "rxFrom" and writes "txTo"
+int addLink(int txFrom, int txTo, int rxFrom, int rxTo)
+{
+    if (directionCount == 2 * MAX_LINKS)
+        return -1;
+
+    for (int i = 0; i < 2; i++)
+    {
+        Direction *dir = calloc(1, sizeof(Direction));
+        if (dir == NULL)
+            return -1;
+        dir->from = (i == 0) ? txFrom : rxFrom;
+        dir->to = (i == 0) ? rxTo : txTo;
+        dir->index = directionCount;
+        directions[directionCount++] = dir;
+    }
+    return 0;
+}
+
+// Build the topology named by "topology", with ports "<prefix><number>":
+// - "pair": one link between ports 10 and 11 (the default).
+// - "pairs N": N independent links, 10 with 11, 12 with 13 and so on.
+// - "chain N": N links in series between ports 10 and 11, relayed by the
+//   cable through pipes, each hop impaired on its own.
+// - "fanout N": port 10 linked to each of ports 11 to 10 + N. What 10 sends
+//   reaches them all, what they send merges into 10 as on a shared line.
+// Returns: 0, or -1 on error.
+int buildTopology(const char *topology, const char *prefix)
+{
+    char kind[16] = "pair";
+    int count = 1;
+    if (topology != NULL && sscanf(topology, "%15s %d", kind, &count) < 1)
+        return -1;
+    if (count < 1 || count > MAX_LINKS)
+    {
+        fprintf(stderr, "Between 1 and %d links\n", MAX_LINKS);
+        return -1;
+    }
+
+    if (strcmp(kind, "pair") == 0 || strcmp(kind, "pairs") == 0)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            int tx = addPort(prefix, 10 + 2 * i);
+            int rx = addPort(prefix, 11 + 2 * i);
+            if (tx < 0 || rx < 0 || addLink(tx, tx, rx, rx) != 0)
+                return -1;
         }
     }
+    else if (strcmp(kind, "chain") == 0)
+    {
+        int tx = addPort(prefix, 10);
+        int rx = addPort(prefix, 11);
+        if (tx < 0 || rx < 0)
+            return -1;
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
+        // Each hop hands over to the next through a pipe per direction
+        int txFrom = tx, txTo = tx;
+        for (int i = 0; i < count; i++)
+        {
+            int forward[2] = {rx, rx}, backward[2] = {rx, rx};
+            if (i < count - 1 && (pipe2(forward, O_NONBLOCK) != 0 || pipe2(backward, O_NONBLOCK) != 0))
+                return -1;
+            if (addLink(txFrom, txTo, backward[0], forward[1]) != 0)
+                return -1;
+            txFrom = forward[0];
+            txTo = backward[1];
+        }
+    }
+    else if (strcmp(kind, "fanout") == 0)
     {
-        perror("tcsetattr");
-        exit(-1);
+        int tx = addPort(prefix, 10);
+        if (tx < 0)
+            return -1;
+        for (int i = 0; i < count; i++)
+        {
+            int rx = addPort(prefix, 11 + i);
+            if (rx < 0 || addLink(tx, tx, rx, rx) != 0)
+                return -1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Unknown topology: %s\n", topology);
+        return -1;
     }
 
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
+    int links = directionCount / 2;
+    for (int i = 0; i < directionCount; i++)
     {
-        perror("tcsetattr");
-        exit(-1);
+        if (links == 1)
+            snprintf(directions[i]->name, sizeof(directions[i]->name), "Tx %c Rx", i % 2 ? '<' : '>');
+        else
+            snprintf(directions[i]->name, sizeof(directions[i]->name), "Link %d Tx %c Rx", i / 2 + 1,
+                     i % 2 ? '<' : '>');
+    }
+    return 0;
+}
+
+// Stop capturing
+void captureClose(void)
+{
+    if (captureFile != NULL && fclose(captureFile) != 0)
+        perror("capture");
+    captureFile = NULL;
+}
+
+// Start capturing every direction to "path", replacing a running capture
+void captureOpen(const char *path)
+{
+    captureClose();
+    captureFile = fopen(path, "wb");
+    if (captureFile == NULL)
+    {
+        perror(path);
+        return;
+    }
+
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    captureOffsetNs = (int64_t)real.tv_sec * 1000000000LL + real.tv_nsec - (int64_t)nowNs();
+
+    // Byte-order magic, version 1.0, section length unknown
+    uint32_t section[4] = {0x1A2B3C4D, 1, 0xFFFFFFFF, 0xFFFFFFFF};
+    captureBlock(PCAPNG_SHB, section, sizeof(section), NULL, 0);
+
+    for (int i = 0; i < 2 * directionCount; i++)
+    {
+        // Link type, snap length, then the options if_name, if_tsresol
+        // (nanoseconds) and the end of options
+        unsigned char idb[8 + 4 + 48 + 4 + 4 + 4] = {0};
+        uint16_t linkType = LINKTYPE_USER0;
+        memcpy(idb, &linkType, 2);
+
+        char name[48];
+        snprintf(name, sizeof(name), "%s %s", directions[i / 2]->name, i % 2 ? "delivered" : "sent");
+        uint16_t nameLength = strlen(name);
+        uint16_t option[2] = {2, nameLength};
+        memcpy(idb + 8, option, 4);
+        memcpy(idb + 12, name, nameLength);
+
+        size_t at = 12 + (nameLength + 3) / 4 * 4;
+        option[0] = 9;
+        option[1] = 1;
+        memcpy(idb + at, option, 4);
+        idb[at + 4] = 9;
+        at += 8 + 4; // The end of options block is zeros already
+
+        captureBlock(PCAPNG_IDB, idb, at, NULL, 0);
+    }
+    fflush(captureFile);
+}
+
+// Remove the port links, so no program opens a dead cable
+void removePorts(void)
+{
+    for (int i = 0; i < portCount; i++)
+        unlink(portLinks[i]);
+}
+
+// A scenario command due "atNs" after the scenario clock started
+typedef struct
+{
+    uint64_t atNs;
+    uint64_t forNs; // Undone this long after, 0 to keep it
+    char command[COMMAND_SIZE];
+} TimelineEvent;
+
+// Pending scenario events, in time order
+static TimelineEvent timeline[MAX_TIMELINE];
+static int timelineCount;
+static uint64_t timelineStart; // 0 until the first byte arrives
+
+// Periodic summary and metrics file
+static uint64_t startNs;
+static uint64_t summaryNs = 1000000000ULL; // Interval, 0 for none
+static uint64_t nextSummaryNs;
+static unsigned long long summaryBytes;   // Traffic at the last summary
+static char metricsPath[256];
+
+void loadScenario(const char *path);
+
+// Update the throughput of a direction since its last sample
+void sampleThroughput(Direction *dir, uint64_t now)
+{
+    if (now > dir->sampleNs)
+        dir->throughput = (dir->bytesOut - dir->sampleBytes) * 1e9 / (now - dir->sampleNs);
+    dir->sampleBytes = dir->bytesOut;
+    dir->sampleNs = now;
+}
+
+// One line per link, for both of its directions
+void printSummary(uint64_t now)
+{
+    for (int i = 0; i < directionCount; i++)
+    {
+        const Direction *dir = directions[i];
+        if (i % 2 == 0)
+            printf("[%9.3fs]", (now - startNs) / 1e9);
+        printf("%s %s: %.1f kB/s, %llu B, %llu chunks, %llu corrupt, %llu dropped, %llu delayed, queue %zu%s",
+               i % 2 == 0 ? "" : " |", dir->name, dir->throughput / 1e3, dir->bytesOut, dir->chunks,
+               dir->bytesCorrupted, dir->bytesDropped, dir->bytesDelayed, dir->end - dir->start,
+               i % 2 == 0 ? "" : "\n");
+    }
+}
+
+// Replace the metrics file with the current counters, as JSON. Written
+// next to it and renamed, so a reader never sees half a file.
+void writeMetrics(uint64_t now)
+{
+    char tmpPath[sizeof(metricsPath) + 8];
+    if (metricsPath[0] == '\0')
+        return;
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", metricsPath);
+
+    FILE *file = fopen(tmpPath, "w");
+    if (file == NULL)
+    {
+        perror(tmpPath);
+        return;
+    }
+
+    fprintf(file, "{\n  \"time_s\": %.6f,\n  \"directions\": [\n", (now - startNs) / 1e9);
+    for (int i = 0; i < directionCount; i++)
+    {
+        const Direction *dir = directions[i];
+        const Latency *latency = &dir->latency;
+
+        fprintf(file,
+                "    {\"name\": \"%s\", \"link\": %d, \"bytes_in\": %llu, \"bytes_out\": %llu, \"chunks\": %llu, "
+                "\"bytes_corrupted\": %llu, \"bit_errors\": %llu, \"bytes_dropped\": %llu, "
+                "\"frames_dropped\": %llu, \"frames_duplicated\": %llu, \"bytes_delayed\": %llu, "
+                "\"queue_depth\": %zu, \"max_queue_depth\": %zu, \"throughput_Bps\": %.1f, "
+                "\"latency_us\": {\"count\": %llu, \"min\": %.1f, \"avg\": %.1f, \"p50\": %.1f, \"p99\": %.1f, "
+                "\"max\": %.1f}}%s\n",
+                dir->name, i / 2 + 1, dir->bytesIn, dir->bytesOut, dir->chunks, dir->bytesCorrupted, dir->bitErrors,
+                dir->bytesDropped, dir->framesDropped, dir->framesDuplicated, dir->bytesDelayed,
+                dir->end - dir->start, dir->maxDepth, dir->throughput, latency->count, latency->minNs / 1e3,
+                latency->count > 0 ? latency->totalNs / 1e3 / latency->count : 0.0,
+                latencyPercentile(latency, 0.5), latencyPercentile(latency, 0.99), latency->maxNs / 1e3,
+                i < directionCount - 1 ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    if (fclose(file) != 0 || rename(tmpPath, metricsPath) != 0)
+        perror(metricsPath);
+}
+
+// Sample throughput, then print a summary if traffic moved since the last
+// one and refresh the metrics file
+void summaryTick(uint64_t now)
+{
+    unsigned long long bytes = 0;
+    for (int i = 0; i < directionCount; i++)
+    {
+        sampleThroughput(directions[i], now);
+        bytes += directions[i]->bytesIn + directions[i]->bytesOut;
+    }
+    if (bytes != summaryBytes)
+    {
+        printSummary(now);
+        fflush(stdout);
+    }
+    summaryBytes = bytes;
+    writeMetrics(now);
+    if (captureFile != NULL)
+        fflush(captureFile);
+    nextSummaryNs = summaryNs > 0 ? now + summaryNs : 0;
+}
+
+// Append a command to "undo", separated from the previous one
+void addUndo(char *undo, size_t undoSize, const char *format, ...)
+{
+    if (undo == NULL)
+        return;
+    size_t used = strlen(undo);
+    if (used > 0 && used + 1 < undoSize)
+    {
+        undo[used++] = ';';
+        undo[used] = '\0';
+    }
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(undo + used, undoSize - used, format, args);
+    va_end(args);
+}
+
+// Run one command, from stdin, the command line or a scenario. Impairment
+// commands apply to every direction of every link, unless their last words
+// pick a direction, "tx" (Tx > Rx) or "rx" (Tx < Rx), and/or a link, "@N".
+// If "undo" is not NULL, the commands that restore what this one changed are
+// written there. Return TRUE for "end".
+int cableCommand(char *line, char *undo, size_t undoSize)
+{
+    char *word[8];
+    int words = 0;
+    for (char *token = strtok(line, " \t\r\n"); token != NULL && words < 8; token = strtok(NULL, " \t\r\n"))
+        word[words++] = token;
+    if (undo != NULL)
+        undo[0] = '\0';
+    if (words == 0)
+        return FALSE;
+
+    const char *sideNames[2] = {"tx", "rx"};
+    int side = -1, link = -1;
+    while (words > 1)
+    {
+        const char *selector = word[words - 1];
+        if (strcasecmp(selector, "tx") == 0 || strcasecmp(selector, "rx") == 0)
+            side = (selector[0] == 'r' || selector[0] == 'R');
+        else if (selector[0] == '@')
+            link = atoi(selector + 1) - 1;
+        else
+            break;
+        words--;
+    }
+    if (link < -1 || link >= directionCount / 2)
+    {
+        printf("No such link\n");
+        return FALSE;
+    }
+
+    double arg[4] = {0};
+    for (int i = 1; i < words && i <= 4; i++)
+        arg[i - 1] = strtod(word[i], NULL);
+
+    const char *cmd = word[0];
+    const char *modeNames[] = {"on", "off", "noise"};
+    CableMode oldMode = cableMode;
+
+    if (strcmp(cmd, "off") == 0 || strcmp(cmd, "0") == 0)
+    {
+        printf("CONNECTION OFF\n");
+        cableMode = CableModeOff;
+    }
+    else if (strcmp(cmd, "on") == 0 || strcmp(cmd, "1") == 0)
+    {
+        printf("CONNECTION ON\n");
+        cableMode = CableModeOn;
+    }
+    else if (strcmp(cmd, "noise") == 0 || strcmp(cmd, "2") == 0)
+    {
+        printf("CONNECTION NOISE\n");
+        cableMode = CableModeNoise;
+    }
+    else if (strcmp(cmd, "stats") == 0)
+    {
+        for (int i = 0; i < directionCount; i++)
+            printDirection(directions[i]);
+        writeMetrics(nowNs());
+    }
+    else if (strcmp(cmd, "end") == 0)
+    {
+        printf("END OF THE PROGRAM\n");
+        return TRUE;
+    }
+    else if (strcmp(cmd, "seed") == 0 && words == 2)
+    {
+        for (int i = 0; i < directionCount; i++)
+            seedDirection(directions[i], strtoull(word[1], NULL, 0), i);
+        printf("SEED %s\n", word[1]);
+    }
+    else if (strcmp(cmd, "summary") == 0 && words == 2)
+    {
+        summaryNs = arg[0] * 1e6 + 0.5;
+        nextSummaryNs = summaryNs > 0 ? nowNs() + summaryNs : 0;
+        printf("SUMMARY every %s ms\n", word[1]);
+    }
+    else if (strcmp(cmd, "metrics") == 0 && words == 2)
+    {
+        snprintf(metricsPath, sizeof(metricsPath), "%s", word[1]);
+        printf("METRICS %s\n", metricsPath);
+    }
+    else if (strcmp(cmd, "capture") == 0 && words == 2)
+    {
+        if (strcmp(word[1], "off") == 0)
+            captureClose();
+        else
+            captureOpen(word[1]);
+        printf("CAPTURE %s\n", word[1]);
+    }
+    else if (strcmp(cmd, "scenario") == 0 && words == 2)
+    {
+        loadScenario(word[1]);
+    }
+    else
+    {
+        for (int i = 0; i < directionCount; i++)
+        {
+            if ((link >= 0 && i / 2 != link) || (side >= 0 && i % 2 != side))
+                continue;
+
+            Impairments *imp = &directions[i]->impairments;
+            Impairments old = *imp;
+            char dir[16];
+            snprintf(dir, sizeof(dir), "@%d %s", i / 2 + 1, sideNames[i % 2]);
+
+            if (strcmp(cmd, "ber") == 0 && words == 2)
+            {
+                imp->ber = arg[0];
+                addUndo(undo, undoSize, "ber %.17g %s", old.ber, dir);
+            }
+            else if (strcmp(cmd, "burst") == 0 && (words == 4 || (words == 2 && arg[0] == 0)))
+            {
+                imp->burstEnter = arg[0];
+                imp->burstLeave = arg[1];
+                imp->burstBer = arg[2];
+                directions[i]->burstBad = FALSE;
+                addUndo(undo, undoSize, "burst %.17g %.17g %.17g %s", old.burstEnter, old.burstLeave, old.burstBer, dir);
+            }
+            else if (strcmp(cmd, "drop") == 0 && words == 2)
+            {
+                imp->drop = arg[0];
+                addUndo(undo, undoSize, "drop %.17g %s", old.drop, dir);
+            }
+            else if (strcmp(cmd, "dup") == 0 && words == 2)
+            {
+                imp->duplicate = arg[0];
+                addUndo(undo, undoSize, "dup %.17g %s", old.duplicate, dir);
+            }
+            else if (strcmp(cmd, "delay") == 0 && (words == 2 || words == 3))
+            {
+                imp->delayNs = arg[0] * 1e6 + 0.5;
+                imp->jitterNs = arg[1] * 1e6 + 0.5;
+                addUndo(undo, undoSize, "delay %.17g %.17g %s", old.delayNs / 1e6, old.jitterNs / 1e6, dir);
+            }
+            else if (strcmp(cmd, "baud") == 0 && words == 2)
+            {
+                imp->baud = arg[0];
+                addUndo(undo, undoSize, "baud %d %s", old.baud, dir);
+            }
+            else if (strcmp(cmd, "clear") == 0 && words == 1)
+            {
+                memset(imp, 0, sizeof(*imp));
+                addUndo(undo, undoSize, "ber %.17g %s;burst %.17g %.17g %.17g %s;drop %.17g %s;dup %.17g %s;"
+                                        "delay %.17g %.17g %s;baud %d %s",
+                        old.ber, dir, old.burstEnter, old.burstLeave, old.burstBer, dir, old.drop, dir,
+                        old.duplicate, dir, old.delayNs / 1e6, old.jitterNs / 1e6, dir, old.baud, dir);
+            }
+            else
+            {
+                printf("Unknown command: %s\n", cmd);
+                return FALSE;
+            }
+            printImpairments(directions[i]);
+        }
+        return FALSE;
+    }
+
+    if (cableMode != oldMode)
+        addUndo(undo, undoSize, "%s", modeNames[oldMode]);
+    return FALSE;
+}
+
+// Insert an event after those due at the same time, so a scenario runs in
+// file order
+void scheduleEvent(uint64_t atNs, uint64_t forNs, const char *command)
+{
+    if (timelineCount == MAX_TIMELINE)
+    {
+        printf("Scenario too long, dropped: %s\n", command);
+        return;
+    }
+
+    int i = timelineCount;
+    while (i > 0 && timeline[i - 1].atNs > atNs)
+    {
+        timeline[i] = timeline[i - 1];
+        i--;
+    }
+    timeline[i].atNs = atNs;
+    timeline[i].forNs = forNs;
+    snprintf(timeline[i].command, COMMAND_SIZE, "%s", command);
+    timelineCount++;
+}
+
+// Parse a time such as "2s", "500ms", "250us" or "1.5" (seconds). Return
+// nanoseconds, or -1 if it is not one.
+int64_t parseTime(const char *text)
+{
+    char *unit;
+    double value = strtod(text, &unit);
+    if (unit == text || value < 0)
+        return -1;
+
+    if (*unit == '\0' || strcmp(unit, "s") == 0)
+        return value * 1e9 + 0.5;
+    if (strcmp(unit, "ms") == 0)
+        return value * 1e6 + 0.5;
+    if (strcmp(unit, "us") == 0)
+        return value * 1e3 + 0.5;
+    return -1;
+}
+
+// Load a scenario: entries separated by newlines or ';', each an optional
+// "t=<time>", a command and an optional "for <time>" after which the
+// command is undone, e.g. "t=2s off for 500ms; t=5s ber 1e-4 for 3s".
+// Entries without "t=" are due at 0. Times count from the first byte the
+// cable receives, so a scenario replays the same against the same traffic.
+void loadScenario(const char *path)
+{
+    static char text[BUF_SIZE];
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return;
+    }
+    size_t size = fread(text, 1, sizeof(text) - 1, file);
+    fclose(file);
+    text[size] = '\0';
+
+    // Loaded while traffic runs, the scenario starts now
+    uint64_t offset = (timelineStart != 0) ? nowNs() - timelineStart : 0;
+
+    char *next;
+    int loaded = 0;
+    for (char *entry = text; entry != NULL; entry = next)
+    {
+        next = strpbrk(entry, ";\n");
+        if (next != NULL)
+            *next++ = '\0';
+
+        char *comment = strchr(entry, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        for (char *c = entry; *c != '\0'; c++)
+            *c = (*c == '\t' || *c == '\r') ? ' ' : *c;
+        while (*entry == ' ')
+            entry++;
+        for (char *end = entry + strlen(entry); end > entry && end[-1] == ' ';)
+            *--end = '\0';
+        if (*entry == '\0')
+            continue;
+
+        // Keywords match in any case, arguments such as paths are kept as is
+        int64_t at = 0, duration = 0;
+        if (strncasecmp(entry, "t=", 2) == 0)
+        {
+            char *end = strchr(entry, ' ');
+            if (end != NULL)
+                *end++ = '\0';
+            at = parseTime(entry + 2);
+            entry = (end != NULL) ? end : "";
+        }
+
+        char *forWord = strchr(entry, ' ');
+        while (forWord != NULL && strncasecmp(forWord, " for ", 5) != 0)
+            forWord = strchr(forWord + 1, ' ');
+        if (forWord != NULL)
+        {
+            *forWord = '\0';
+            duration = parseTime(forWord + 5 + strspn(forWord + 5, " "));
+        }
+
+        for (char *c = entry + strspn(entry, " "); *c != '\0' && *c != ' '; c++)
+            *c = (*c >= 'A' && *c <= 'Z') ? *c - 'A' + 'a' : *c;
+
+        if (at < 0 || duration < 0 || strspn(entry, " ") == strlen(entry))
+        {
+            printf("Bad scenario entry in %s: %s\n", path, entry);
+            continue;
+        }
+        scheduleEvent(offset + at, duration, entry);
+        loaded++;
+    }
+
+    printf("SCENARIO %s: %d entries\n", path, loaded);
+}
+
+// Run the scenario events that are due
+void runTimeline(uint64_t now)
+{
+    // Room for "clear" on every direction, plus a mode change
+    size_t undoSize = ((size_t)directionCount * UNDO_COMMANDS + 1) * COMMAND_SIZE;
+    char *undo = NULL;
+
+    while (timelineStart != 0 && timelineCount > 0 && timelineStart + timeline[0].atNs <= now)
+    {
+        TimelineEvent event = timeline[0];
+        memmove(timeline, timeline + 1, --timelineCount * sizeof(TimelineEvent));
+
+        printf("t=%.3fs %s\n", event.atNs / 1e9, event.command);
+        if (event.forNs > 0 && undo == NULL && (undo = malloc(undoSize)) == NULL)
+            printf("Out of memory, not undone: %s\n", event.command);
+        cableCommand(event.command, event.forNs > 0 ? undo : NULL, undoSize);
+
+        // Undone on the scenario's clock, not the late wakeup's
+        if (event.forNs > 0 && undo != NULL)
+        {
+            char *next;
+            for (char *command = undo; command != NULL && *command != '\0'; command = next)
+            {
+                next = strchr(command, ';');
+                if (next != NULL)
+                    *next++ = '\0';
+                scheduleEvent(event.atNs + event.forNs, 0, command);
+            }
+        }
+    }
+    free(undo);
+    fflush(stdout);
+}
+
+// Start the scenario clock, once
+void startTimeline(void)
+{
+    if (timelineStart == 0)
+    {
+        timelineStart = nowNs();
+        runTimeline(timelineStart);
+    }
+}
+
+// Absolute time of the next scenario event, 0 if none is waiting
+uint64_t timelineWake(void)
+{
+    return (timelineStart != 0 && timelineCount > 0) ? timelineStart + timeline[0].atNs : 0;
+}
+
+// Frames reassembled from the chunks of one capture interface
+typedef struct
+{
+    char name[48];
+    int nsResolution; // Timestamp units per second is 10^nsResolution
+    unsigned char frame[DISSECT_FRAME];
+    int size;
+    int escaped;
+    uint64_t lastFrameNs;
+    unsigned long long frames[FRAME_KINDS];
+} Stream;
+
+static const char *frameKinds[FRAME_KINDS] = {"SET", "UA", "I", "RR", "REJ", "DISC", "other", "bad"};
+
+// Name a frame from its address, control and BCC1 onwards, as the link
+// layer builds them. Returns: its kind.
+int describeFrame(const unsigned char *frame, int size, char *text, size_t textSize)
+{
+    unsigned char c = frame[1];
+
+    if (size < 3 || frame[2] != (frame[0] ^ c))
+    {
+        snprintf(text, textSize, "bad header (%d bytes)", size);
+        return FrameBad;
+    }
+
+    if (size == 3)
+    {
+        int kind = FrameOther;
+        if ((c & ~0x40) == 0x03)
+        {
+            kind = FrameSet;
+            snprintf(text, textSize, "SET%s", c & 0x40 ? " (compression offered)" : "");
+        }
+        else if ((c & ~0x40) == 0x07)
+        {
+            kind = FrameUa;
+            snprintf(text, textSize, "UA%s", c & 0x40 ? " (compression accepted)" : "");
+        }
+        else if (c == 0x0B)
+        {
+            kind = FrameDisc;
+            snprintf(text, textSize, "DISC");
+        }
+        else if ((c & 0x7F) == 0x05 || (c & 0x7F) == 0x01)
+        {
+            kind = (c & 0x7F) == 0x05 ? FrameRr : FrameRej;
+            snprintf(text, textSize, "%s%d", frameKinds[kind], c >> 7);
+        }
+        else
+            snprintf(text, textSize, "control 0x%02X", c);
+        return kind;
+    }
+
+    // I-frame: payload and BCC2, with the payload flags in the control field
+    unsigned char bcc2 = 0;
+    for (int i = 3; i < size - 1; i++)
+        bcc2 ^= frame[i];
+
+    int duplexFrame = (c & ~(0xC0 | 0x28)) == 0x10;
+    if ((c & ~(0x80 | 0x28)) != 0 && !duplexFrame)
+    {
+        snprintf(text, textSize, "control 0x%02X with %d bytes", c, size - 4);
+        return FrameOther;
+    }
+
+    char nr[8] = "";
+    if (duplexFrame)
+        snprintf(nr, sizeof(nr), " nr=%d", (c >> 6) & 1);
+    snprintf(text, textSize, "I ns=%d%s%s%s, %d bytes, BCC2 %s", c >> 7, nr, c & 0x20 ? " coalesced" : "",
+             c & 0x08 ? " compressed" : "", size - 4, bcc2 == frame[size - 1] ? "ok" : "BAD");
+    return bcc2 == frame[size - 1] ? FrameI : FrameBad;
+}
+
+// Destuff a chunk into frames, printing each complete one
+void dissectChunk(Stream *streams, int interface, uint64_t ts, uint64_t firstNs, const unsigned char *data,
+                  size_t size)
+{
+    Stream *stream = &streams[interface];
+    Stream *peer = &streams[interface ^ 2]; // Same capture point, other direction
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (data[i] != 0x7E)
+        {
+            if (data[i] == 0x7D)
+                stream->escaped = TRUE;
+            else if (stream->size < DISSECT_FRAME)
+            {
+                stream->frame[stream->size++] = stream->escaped ? data[i] ^ 0x20 : data[i];
+                stream->escaped = FALSE;
+            }
+            continue;
+        }
+
+        // A flag ends the frame, if there is one
+        if (stream->size > 0)
+        {
+            char text[96];
+            int kind = describeFrame(stream->frame, stream->size, text, sizeof(text));
+            stream->frames[kind]++;
+
+            printf("%12.6f  %-26s  %-52s", (ts - firstNs) / 1e9, stream->name, text);
+            if (peer->lastFrameNs != 0)
+                printf("  +%.3f ms after peer", (ts - peer->lastFrameNs) / 1e6);
+            printf("\n");
+            stream->lastFrameNs = ts;
+        }
+        stream->size = 0;
+        stream->escaped = FALSE;
+    }
+}
+
+// Decode the SET, UA, I, RR, REJ and DISC frames of a capture, with their
+// timestamps and the time since the last frame the other side sent.
+// Returns: 0, or -1 if the file is not a capture of this cable.
+int dissectCapture(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    static Stream streams[4 * MAX_LINKS];
+    static unsigned char block[BUF_SIZE + 64];
+    int interfaces = 0;
+    uint64_t firstNs = 0;
+    uint32_t head[2];
+
+    while (fread(head, 4, 2, file) == 2)
+    {
+        uint32_t type = head[0], total = head[1];
+        if (total < 12 || total - 8 > sizeof(block) || fread(block, 1, total - 8, file) != total - 8)
+        {
+            fprintf(stderr, "%s: truncated or unsupported block\n", path);
+            break;
+        }
+        uint32_t bodySize = total - 12;
+
+        if (type == PCAPNG_SHB && *(uint32_t *)block != 0x1A2B3C4D)
+        {
+            fprintf(stderr, "%s: other byte order, not supported\n", path);
+            fclose(file);
+            return -1;
+        }
+        else if (type == PCAPNG_IDB && interfaces < 4 * MAX_LINKS)
+        {
+            Stream *stream = &streams[interfaces++];
+            snprintf(stream->name, sizeof(stream->name), "interface %d", interfaces - 1);
+            stream->nsResolution = 6;
+
+            for (uint32_t at = 8; at + 4 <= bodySize;)
+            {
+                uint16_t code = *(uint16_t *)(block + at), length = *(uint16_t *)(block + at + 2);
+                if (code == 0 || at + 4 + length > bodySize)
+                    break;
+                if (code == 2)
+                    snprintf(stream->name, sizeof(stream->name), "%.*s", length, (char *)block + at + 4);
+                else if (code == 9 && length == 1)
+                    stream->nsResolution = block[at + 4];
+                at += 4 + (length + 3) / 4 * 4;
+            }
+        }
+        else if (type == PCAPNG_EPB && bodySize >= 20)
+        {
+            uint32_t *packet = (uint32_t *)block;
+            if (packet[0] >= (uint32_t)interfaces || 20 + packet[3] > bodySize)
+                continue;
+
+            Stream *stream = &streams[packet[0]];
+            uint64_t ts = (uint64_t)packet[1] << 32 | packet[2];
+            for (int i = stream->nsResolution; i < 9; i++)
+                ts *= 10;
+            if (firstNs == 0)
+                firstNs = ts;
+            dissectChunk(streams, packet[0], ts, firstNs, block + 20, packet[3]);
+        }
+    }
+    fclose(file);
+
+    printf("\n");
+    for (int i = 0; i < interfaces; i++)
+    {
+        printf("%s:", streams[i].name);
+        for (int kind = 0; kind < FRAME_KINDS; kind++)
+            printf(" %llu %s%s", streams[i].frames[kind], frameKinds[kind], kind < FRAME_KINDS - 1 ? "," : "\n");
+    }
+    return 0;
+}
+
+// SIGINT and SIGTERM end the cable like "end", removing its port links
+void stopCable(int signal)
+{
+    STOP = TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+    // Offline, no ports: decode a capture and leave
+    if (argc == 3 && strcmp(argv[1], "dissect") == 0)
+        return dissectCapture(argv[2]) == 0 ? 0 : 1;
+
+    printf("\n");
+
+    // The ports are "<prefix><number>", /dev/ttyS10 and /dev/ttyS11 by
+    // default, so several cables can run side by side
+    const char *prefix = getenv("CABLE_PREFIX");
+    if (prefix == NULL)
+        prefix = "/dev/ttyS";
+
+    if (buildTopology(getenv("CABLE_TOPOLOGY"), prefix) != 0)
+    {
+        removePorts();
+        exit(-1);
+    }
+
+    signal(SIGINT, stopCable);
+    signal(SIGTERM, stopCable);
+
+    if (directionCount == 2 && portCount == 2)
+        printf("Transmitter must open %s\n"
+               "Receiver must open %s\n",
+               portLinks[0], portLinks[1]);
+    else if (portCount == 2)
+        printf("Transmitter must open %s\n"
+               "Receiver must open %s\n"
+               "They are %d hops apart\n",
+               portLinks[0], portLinks[1], directionCount / 2);
+    else if (portCount == directionCount)
+        for (int i = 0; i < portCount; i += 2)
+            printf("Link %d: transmitter must open %s, receiver %s\n", i / 2 + 1, portLinks[i], portLinks[i + 1]);
+    else
+        for (int i = 1; i < portCount; i++)
+            printf("Link %d: transmitter must open %s, receiver %s\n", i, portLinks[0], portLinks[i]);
+    printf("\n");
+
+    printf("The cable program is sensible to the following interactive commands:\n"
+           "--- on           : connect the cable and data is exchanged (default state)\n"
+           "--- off          : disconnect the cable disabling data to be exchanged\n"
+           "--- noise        : add fixed noise to the cable\n"
+           "--- stats        : print traffic and added latency per direction\n"
+           "--- summary MS   : print a one-line traffic summary every MS ms while traffic flows (default 1000, 0: off)\n"
+           "--- metrics FILE : keep FILE updated with all counters as JSON, at every summary and at the end\n"
+           "--- capture FILE : capture both directions, as sent and as delivered, to a pcapng FILE (off: stop);\n"
+           "                   \"./cable dissect FILE\" decodes its frames\n"
+           "--- end          : terminate the program\n"
+           "Impairments, for every link and direction or only those picked by final words: a direction,\n"
+           "\"tx\" or \"rx\", and/or a link, \"@N\":\n"
+           "--- ber P                : flip each bit with probability P\n"
+           "--- burst E L P          : Gilbert-Elliott bursts, entered with probability E and left\n"
+           "                           with probability L per byte, bit error rate P inside (burst 0: off)\n"
+           "--- drop P / dup P       : lose / repeat each frame with probability P\n"
+           "--- delay MS [JITTER]    : propagation delay plus up to JITTER ms more\n"
+           "--- baud RATE            : limit the line to RATE bit/s (8N1), 0 for no limit\n"
+           "--- clear                : remove all impairments\n"
+           "--- seed N               : restart the random generators from seed N (default 1)\n"
+           "--- scenario FILE        : run a timeline such as \"t=2s off for 500ms; t=5s ber 1e-4 for 3s\",\n"
+           "                           timed from the first byte the cable receives\n"
+           "The same commands can be given as arguments, e.g. ./cable \"ber 1e-5\" \"delay 20 5 @2 rx\"\n"
+           "CABLE_TOPOLOGY picks the links: \"pair\" (default), \"pairs N\", \"chain N\" or \"fanout N\"\n"
+           "\n");
+
+    // Configure stdin to receive commands to this program
+    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+
+    // Wait on both ports, stdin and the delay timer at once
+    int epfd = epoll_create1(0);
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (epfd < 0 || timerFd < 0)
+    {
+        perror("epoll_create1");
+        exit(-1);
+    }
+
+    // Every port and relay pipe end, watched as the directions need
+    int fds[4 * MAX_LINKS];
+    int fdCount = 0;
+    for (int i = 0; i < directionCount; i++)
+    {
+        int ends[2] = {directions[i]->from, directions[i]->to};
+        for (int j = 0; j < 2; j++)
+        {
+            int known = FALSE;
+            for (int k = 0; k < fdCount; k++)
+                known |= (fds[k] == ends[j]);
+            if (!known)
+                fds[fdCount++] = ends[j];
+        }
+    }
+
+    for (int i = 0; i < fdCount + 2; i++)
+    {
+        int fd = (i < fdCount) ? fds[i] : (i == fdCount) ? STDIN_FILENO : timerFd;
+        struct epoll_event ev = {.events = (i < fdCount) ? 0 : EPOLLIN, .data.fd = fd};
+        // A stdin epoll cannot watch, such as /dev/null, only gives no commands
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1 && !(fd == STDIN_FILENO && errno == EPERM))
+        {
+            perror("epoll_ctl");
+            removePorts();
+            exit(-1);
+        }
+    }
+
+    startNs = nowNs();
+    for (int i = 0; i < directionCount; i++)
+    {
+        seedDirection(directions[i], 1, i);
+        directions[i]->sampleNs = startNs;
+    }
+    nextSummaryNs = startNs + summaryNs;
+
+    char rxStdin[BUF_SIZE] = {0};
+
+    for (int i = 1; i < argc && STOP == FALSE; i++)
+    {
+        snprintf(rxStdin, sizeof(rxStdin), "%s", argv[i]);
+        STOP = cableCommand(rxStdin, NULL, 0);
+    }
+
+    printf("Cable ready\n");
+    fflush(stdout);
+
+    while (STOP == FALSE)
+    {
+        for (int i = 0; i < fdCount; i++)
+            watchFd(epfd, fds[i]);
+        uint64_t wake = 0;
+        for (int i = 0; i < directionCount; i++)
+            wake = earliest(wake, nextWake(directions[i]));
+        armTimer(timerFd, earliest(earliest(wake, timelineWake()), nextSummaryNs));
+
+        struct epoll_event events[MAX_EVENTS];
+        int nEvents = epoll_wait(epfd, events, MAX_EVENTS, -1);
+
+        if (nEvents < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < nEvents; i++)
+        {
+            int ready = events[i].data.fd;
+
+            if (ready == timerFd)
+            {
+                uint64_t expirations;
+                read(timerFd, &expirations, sizeof(expirations));
+                uint64_t now = nowNs();
+                runTimeline(now);
+                if (nextSummaryNs != 0 && now >= nextSummaryNs)
+                    summaryTick(now);
+                for (int j = 0; j < directionCount; j++)
+                    writeDirection(directions[j]);
+            }
+            else if (ready == STDIN_FILENO)
+            {
+                // Read commands from STDIN to control the cable
+                int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE - 1);
+                if (fromStdin == 0)
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL); // Closed, keep running on arguments
+                if (fromStdin <= 0)
+                    continue;
+                rxStdin[fromStdin] = '\0';
+
+                char *next;
+                for (char *line = rxStdin; line != NULL && STOP == FALSE; line = next)
+                {
+                    next = strchr(line, '\n');
+                    if (next != NULL)
+                        *next++ = '\0';
+                    STOP = cableCommand(line, NULL, 0);
+                }
+                fflush(stdout);
+            }
+            else
+            {
+                // Pass what was read straight on, most chunks never wait in the pipe
+                if (events[i].events & EPOLLIN)
+                {
+                    // The scenario clock starts with the first byte
+                    startTimeline();
+                    readPort(ready);
+                    for (int j = 0; j < directionCount; j++)
+                    {
+                        if (directions[j]->from == ready)
+                            writeDirection(directions[j]);
+                    }
+                }
+                if (events[i].events & EPOLLOUT)
+                    writePort(ready);
+            }
+        }
     }
 
-    close(fdTx);
-    close(fdRx);
+    for (int i = 0; i < directionCount; i++)
+        printDirection(directions[i]);
+    writeMetrics(nowNs());
+    captureClose();
+    close(timerFd);
+    close(epfd);
 
-    system("killall socat");
+    removePorts();
+    for (int i = 0; i < portCount; i++)
+        close(portSlaves[i]);
+    for (int i = 0; i < fdCount; i++)
+        close(fds[i]);
+    for (int i = 0; i < directionCount; i++)
+        free(directions[i]);
 
     return 0;
 }
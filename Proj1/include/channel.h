@@ -0,0 +1,65 @@
+// Logical channels sharing one link, with a weighted priority scheduler
+// that picks the next packet to send at every frame boundary.
+
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+#include <stdint.h>
+#include "packet_queue.h"
+
+#define MAX_CHANNELS 4
+
+// Latency histogram buckets, powers of two in microseconds
+#define LATENCY_BUCKETS 32
+
+typedef struct
+{
+    unsigned long long count;
+    uint64_t totalNs;
+    uint64_t maxNs;
+    unsigned long long buckets[LATENCY_BUCKETS];
+} LatencyStats;
+
+typedef struct
+{
+    int id;
+    const char *name;
+    PacketQueue *queue;
+    int priority;  // Lower goes first
+    int weight;    // Frames per round while other channels wait
+    int credits;   // Frames left in the current round
+
+    unsigned long long frames;
+    unsigned long long bytes;
+    LatencyStats latency; // From queueing to acknowledgment
+} Channel;
+
+typedef struct
+{
+    Channel *channels[MAX_CHANNELS];
+    int count;
+} Scheduler;
+
+// Initialize a channel fed by "queue".
+void channelInit(Channel *channel, int id, const char *name, PacketQueue *queue, int priority, int weight);
+
+// Add a channel to the scheduler.
+void schedulerAdd(Scheduler *scheduler, Channel *channel);
+
+// Return the channel whose oldest packet goes next, blocking while every
+// queue is empty. Return NULL once "primary" is closed and drained.
+Channel *schedulerNext(Scheduler *scheduler, Channel *primary);
+
+// Record that the oldest packet of the channel was acknowledged.
+void channelSent(Channel *channel, int size);
+
+// Add a latency sample.
+void latencyAdd(LatencyStats *stats, uint64_t ns);
+
+// Print a one-line latency summary.
+void latencyPrint(const LatencyStats *stats, const char *label);
+
+// Print frame, byte and latency counters of every channel.
+void schedulerStats(const Scheduler *scheduler);
+
+#endif // _CHANNEL_H_
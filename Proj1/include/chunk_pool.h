@@ -0,0 +1,79 @@
+// Worker pool that transforms file chunks in parallel and hands them back
+// in the order they were submitted.
+
+#ifndef _CHUNK_POOL_H_
+#define _CHUNK_POOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include "lz.h"
+
+// Raw bytes per chunk, the LZ window covers the whole chunk
+#define CHUNK_SIZE 65536
+
+// Chunk record header: raw offset (8), raw size (4), stored size (4)
+#define CHUNK_HEADER_SIZE 16
+
+// Room for a record with a worst-case compressed chunk
+#define CHUNK_BUF_SIZE (CHUNK_HEADER_SIZE + LZ_BOUND(CHUNK_SIZE))
+
+#define CHUNK_POOL_MAX_WORKERS 4
+#define CHUNK_POOL_SLOTS (2 * CHUNK_POOL_MAX_WORKERS)
+
+typedef struct
+{
+    unsigned char in[CHUNK_BUF_SIZE];
+    unsigned char out[CHUNK_BUF_SIZE];
+    int inSize;
+    int outSize; // Set by the work function, -1 on failure
+    uint64_t offset;
+    int done;
+} Chunk;
+
+typedef struct ChunkPool ChunkPool;
+
+// Transformation applied to a chunk by a worker
+typedef void (*ChunkWork)(Chunk *chunk);
+
+struct ChunkPool
+{
+    Chunk chunks[CHUNK_POOL_SLOTS];
+    pthread_t workers[CHUNK_POOL_MAX_WORKERS];
+    int workerCount;
+    ChunkWork work;
+
+    pthread_mutex_t lock;
+    pthread_cond_t submitted; // A chunk is waiting for a worker
+    pthread_cond_t finished;  // A worker finished a chunk
+    unsigned int released;    // Chunks given back by the owner
+    unsigned int claimed;     // Chunks taken by workers
+    unsigned int queued;      // Chunks submitted by the owner
+    int stop;
+};
+
+// Start "workers" threads (at most CHUNK_POOL_MAX_WORKERS) applying "work".
+int chunkPoolInit(ChunkPool *pool, ChunkWork work, int workers);
+
+// Return a free chunk to fill, or NULL when every chunk is in flight.
+Chunk *chunkPoolAcquire(ChunkPool *pool);
+
+// Hand the chunk returned by chunkPoolAcquire to the workers.
+void chunkPoolSubmit(ChunkPool *pool);
+
+// Return the oldest submitted chunk once its work is done, blocking until
+// then. Return NULL when nothing was submitted.
+Chunk *chunkPoolCollect(ChunkPool *pool);
+
+// Give back the chunk returned by chunkPoolCollect.
+void chunkPoolRelease(ChunkPool *pool);
+
+// Return the number of submitted chunks not released yet.
+int chunkPoolPending(ChunkPool *pool);
+
+// Stop and join the workers.
+void chunkPoolDestroy(ChunkPool *pool);
+
+// Number of workers to use on this machine.
+int chunkPoolDefaultWorkers(void);
+
+#endif // _CHUNK_POOL_H_
@@ -0,0 +1,61 @@
+// Block signatures and rolling checksums for rsync-style delta transfers.
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Signature of one block of the receiver's existing file
+typedef struct
+{
+    uint32_t weak;   // Rolling checksum
+    uint64_t strong; // XXH64 of the block
+} BlockSignature;
+
+// Rolling checksum over a window that slides one byte at a time
+typedef struct
+{
+    uint32_t a;
+    uint32_t b;
+    size_t length;
+} RollingSum;
+
+// Blocks of the receiver's file, looked up by rolling checksum
+typedef struct
+{
+    const BlockSignature *blocks;
+    int count;
+    size_t blockSize;
+    int *heads; // First block of each bucket, -1 if empty
+    int *next;  // Next block with the same bucket, -1 at the end
+    unsigned int mask;
+} SignatureIndex;
+
+// Block size to use for a file of "fileSize" bytes.
+size_t deltaBlockSize(uint64_t fileSize);
+
+// Start a rolling checksum over the "length" bytes at "data".
+void rollingInit(RollingSum *sum, const unsigned char *data, size_t length);
+
+// Slide the window one byte: drop "out" at the front, add "in" at the back.
+void rollingRotate(RollingSum *sum, unsigned char out, unsigned char in);
+
+// Return the checksum of the current window.
+uint32_t rollingDigest(const RollingSum *sum);
+
+// Compute the signature of a block.
+void blockSignature(const unsigned char *data, size_t length, BlockSignature *sig);
+
+// Index "count" signatures of "blockSize" blocks. Return -1 if out of memory.
+int signatureIndexBuild(SignatureIndex *index, const BlockSignature *blocks, int count, size_t blockSize);
+
+// Return the block matching the "blockSize" bytes at "data" whose rolling
+// checksum is "weak", or -1 if there is none. Block "prefer" is tried first,
+// so runs of consecutive blocks stay together.
+int signatureIndexFind(const SignatureIndex *index, uint32_t weak, const unsigned char *data, int prefer);
+
+// Free the index tables.
+void signatureIndexFree(SignatureIndex *index);
+
+#endif // _DELTA_H_
@@ -0,0 +1,27 @@
+// Streaming 64-bit hash (XXH64) used to verify transfers end to end.
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    uint64_t totalLen;
+    uint64_t v[4];
+    unsigned char mem[32]; // Bytes not yet consumed by a full 32-byte stripe
+    unsigned int memSize;
+    uint64_t seed;
+} HashState;
+
+// Start a new hash computation.
+void hashInit(HashState *state, uint64_t seed);
+
+// Feed "size" bytes to the hash.
+void hashUpdate(HashState *state, const unsigned char *data, size_t size);
+
+// Return the hash of all bytes fed so far.
+uint64_t hashDigest(const HashState *state);
+
+#endif // _HASH_H_
@@ -0,0 +1,29 @@
+// Checkpoint journal kept next to a file being received, so an interrupted
+// transfer can resume from the last confirmed byte.
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hash.h"
+
+typedef struct
+{
+    uint64_t fileSize;  // Identity of the source file: size...
+    uint64_t mtime;     // ...and modification time in nanoseconds
+    uint64_t confirmed; // Bytes from the start known to be on disk
+    HashState hash;     // Hash of those bytes, to keep verifying on resume
+} Checkpoint;
+
+// Write the journal path for "output" into "path".
+void journalPath(char *path, size_t size, const char *output);
+
+// Load the checkpoint at "path" if it is intact and describes the same
+// source file. Return 0 on success, -1 otherwise.
+int journalLoad(const char *path, uint64_t fileSize, uint64_t mtime, Checkpoint *checkpoint);
+
+// Store a checkpoint durably. Return 0 on success, -1 on error.
+int journalSave(int fd, const Checkpoint *checkpoint);
+
+#endif // _JOURNAL_H_
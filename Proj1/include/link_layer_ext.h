@@ -0,0 +1,17 @@
+// Link layer calls beyond the fixed interface of link_layer.h, which must
+// not be changed.
+
+#ifndef _LINK_LAYER_EXT_H_
+#define _LINK_LAYER_EXT_H_
+
+#include "link_layer.h"
+
+// Send a frame whose payload is "header" followed by "data" (may be NULL),
+// without first copying them into one buffer.
+// Return number of chars written, or "-1" on error.
+int llwritev(const unsigned char *header, int headerSize, const unsigned char *data, int dataSize);
+
+// Read an on/off option from the environment (unset or "0" means off).
+int envFlag(const char *name);
+
+#endif // _LINK_LAYER_EXT_H_
@@ -0,0 +1,18 @@
+// LZ4-compatible block compressor used to shrink payloads before they
+// cross the serial line.
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+// Worst-case compressed size of "size" input bytes
+#define LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+// Compress "size" bytes of "src" into "dst" (at least LZ_BOUND(size) bytes).
+// Return the compressed size.
+int lzCompress(const unsigned char *src, int size, unsigned char *dst);
+
+// Decompress "size" bytes of "src" into "dst" of capacity "capacity".
+// Return the decompressed size, or "-1" on malformed input.
+int lzDecompress(const unsigned char *src, int size, unsigned char *dst, int capacity);
+
+#endif // _LZ_H_
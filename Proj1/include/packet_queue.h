@@ -0,0 +1,81 @@
+// Bounded single-producer single-consumer packet queue between a file I/O
+// thread and the link layer thread.
+
+#ifndef _PACKET_QUEUE_H_
+#define _PACKET_QUEUE_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "link_layer.h"
+
+// Number of packets the queue can hold (power of two)
+#define PACKET_QUEUE_DEPTH 128
+
+// Size of each slot, large enough for an llread destination buffer
+#define PACKET_SLOT_SIZE ((MAX_PAYLOAD_SIZE + 4) * 2)
+
+typedef struct
+{
+    unsigned char slots[PACKET_QUEUE_DEPTH][PACKET_SLOT_SIZE];
+    int sizes[PACKET_QUEUE_DEPTH];
+    uint64_t stamps[PACKET_QUEUE_DEPTH]; // Push time of each packet (monotonic ns)
+    atomic_uint head;   // Next slot to pop, written by the consumer only
+    atomic_uint tail;   // Next slot to push, written by the producer only
+    atomic_int closed;  // Producer has finished
+
+    // Statistics, each field owned by one side
+    int maxDepth;
+    unsigned long long depthSum;
+    unsigned long long samples; // Consumer depth samples
+    unsigned long long producerStalls; // Producer found the queue full
+    unsigned long long consumerStalls; // Consumer found the queue empty
+} PacketQueue;
+
+// Initialize an empty queue.
+void packetQueueInit(PacketQueue *q);
+
+// Return the next free slot, blocking while the queue is full.
+unsigned char *packetQueueReserve(PacketQueue *q);
+
+// Publish the slot returned by packetQueueReserve holding "size" bytes.
+void packetQueuePush(PacketQueue *q, int size);
+
+// Block until at least "count" packets are queued or the queue is closed.
+// Return the number of packets available.
+int packetQueueWait(PacketQueue *q, int count);
+
+// Return the oldest packet and its size, blocking while the queue is empty.
+// Return NULL once the queue is closed and drained.
+unsigned char *packetQueueFront(PacketQueue *q, int *size);
+
+// Return the packet "index" positions after the oldest one, or NULL if it
+// has not been pushed yet. Never blocks.
+unsigned char *packetQueuePeek(PacketQueue *q, int index, int *size);
+
+// Return the time the oldest packet was pushed, in monotonic nanoseconds.
+uint64_t packetQueueStamp(const PacketQueue *q);
+
+// Release the "count" oldest packets.
+void packetQueuePop(PacketQueue *q, int count);
+
+// Mark the end of the stream, waking up a waiting consumer.
+void packetQueueClose(PacketQueue *q);
+
+// Return TRUE once the producer closed the queue.
+int packetQueueClosed(PacketQueue *q);
+
+// Return a ticket to take before checking queues that may have to be
+// waited on.
+unsigned int packetQueueTicket(void);
+
+// Wait before checking the queues again: yield for the first few "spins",
+// then sleep until any queue changed since "ticket" was taken.
+void packetQueueBackoff(int *spins, unsigned int ticket);
+
+// Return the monotonic clock in nanoseconds.
+uint64_t monotonicNs(void);
+
+// Print depth and stall counters.
+void packetQueueStats(const PacketQueue *q, const char *name);
+
+#endif // _PACKET_QUEUE_H_
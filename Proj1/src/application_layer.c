@@ -1,124 +1,2096 @@
 // Application layer protocol implementation
 
+#define _FILE_OFFSET_BITS 64 // 64-bit off_t for fseeko/ftello on every platform
+
 #include "application_layer.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
-#include "link_layer.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include "channel.h"
+#include "chunk_pool.h"
+#include "delta.h"
+#include "hash.h"
+#include "journal.h"
+#include "link_layer_ext.h"
+#include "packet_queue.h"
+
+struct applicationLayer
+{
+int fileDescriptor; /*Descritor correspondente à porta série*/
+int status; /*TRANSMITTER | RECEIVER*/
+};
+
+#define END_PACKET 0x03
+#define START_PACKET 0x02
+#define DATA_PACKET 0x01
+#define MANIFEST_PACKET 0x04  // Starts a batch: file count and total size
+#define BUNDLE_PACKET 0x05    // Several packets in one frame, each prefixed by a 16-bit length
+#define BATCH_END_PACKET 0x06 // Ends a batch session
+#define ZDATA_PACKET 0x07     // Like DATA, but a slice of the compressed chunk stream
+#define SIGNATURE_PACKET 0x08 // Receiver to transmitter: block signatures of its copy
+#define REF_PACKET 0x09       // Copy bytes of the receiver's old copy into the file
+#define RESUME_PACKET 0x0A    // Receiver to transmitter: byte to resume from
+#define CHANNEL_PACKET 0x0B   // Message on a logical channel other than the file
+
+// Control packet TLV types
+#define T_SIZE 0x00
+#define T_NAME 0x01
+#define T_COUNT 0x02
+#define T_HASH 0x03 // END only: XXH64 of the file contents
+#define T_DELTA 0x04 // START only, empty: send the signature of the existing copy
+#define T_MTIME 0x05 // START only: source modification time in nanoseconds
+#define T_RESUME 0x06 // START only, empty: keep a journal and reply where to resume
+
+// In batch mode, files up to this size are read in one go and bundled
+#define SMALL_FILE_SIZE 65536
+
+// A bundle with less room than this for file bytes is sent rather than
+// topped up with one more DATA header
+#define MIN_BUNDLED_DATA 64
+
+// Size of a stream whose length is only known at its END packet
+#define UNKNOWN_SIZE UINT64_MAX
+
+// SIGNATURE packet: C, block size, block count, first block index (32 bits
+// each), then a 32-bit rolling checksum and 64-bit hash per block
+#define SIGNATURE_HEADER_SIZE 13
+#define SIGNATURE_ENTRY_SIZE 12
+
+// REF packet: C, 64-bit destination offset, 64-bit source offset, 32-bit length
+#define REF_PACKET_SIZE 21
+
+// RESUME packet: C, 64-bit offset
+#define RESUME_PACKET_SIZE 9
+
+// CHANNEL packet: C, channel id, 64-bit send time (realtime ns), message
+#define CHANNEL_HEADER_SIZE 10
+#define CONTROL_CHANNEL 1
+
+// Control frames sent per file frame while both are waiting
+#define CONTROL_WEIGHT 8
+
+// The receiver confirms progress in its journal this often
+#define JOURNAL_INTERVAL (256 * 1024)
+
+// DATA packet: C, 64-bit byte offset, 16-bit length, data
+#define DATA_HEADER_SIZE 11
+#define DATA_CHUNK_SIZE (MAX_PAYLOAD_SIZE - DATA_HEADER_SIZE)
+
+// Memory-mapped file I/O instead of FILE* reads and queued writes (APP_MMAP)
+int useMmap = FALSE;
+
+// File bytes moved by this end, for the CPU cost report
+uint64_t transferBytes = 0;
+
+// Transmit source is a pipe or terminal, read as data becomes available
+int streamInput = FALSE;
+
+// Hash of the DATA sent for the current file, carried in its END packet
+HashState txHash;
+
+// Compress file chunks on a worker pool before sending them (APP_COMPRESS)
+int useCompress = FALSE;
+ChunkPool chunkPool;
+int chunkPoolStarted = FALSE;
+
+// Send files as a delta against the receiver's existing copy (APP_DELTA)
+int useDelta = FALSE;
+int deltaTransfer = FALSE; // The current file is sent as a delta
+
+// Resumable transfers: the receiver journals confirmed bytes (APP_RESUME)
+int useResume = FALSE;
+int resumeTransfer = FALSE; // The current file asks for a journal
+uint64_t sourceMtime = 0;   // Identifies the source in the journal
+uint64_t resumeOffset = 0;  // First byte the receiver still needs
+
+// Logical channels: the file on channel 0 and, with APP_CONTROL, a command
+// stream on channel 1 that goes ahead of file DATA at frame boundaries
+Scheduler scheduler;
+Channel fileChannel;
+Channel controlChannel;
+PacketQueue controlQueue;
+int controlActive = FALSE;
+pthread_t controlId;
+int controlStop[2] = {-1, -1}; // Written once to end the control thread
+
+// Compression counters, owned by the thread feeding the pool
+unsigned long long chunks = 0;
+unsigned long long storedChunks = 0;
+uint64_t chunkRawBytes = 0;
+uint64_t chunkStreamBytes = 0;
+
+// File bytes per DATA packet, smaller than the largest frame allows with
+// APP_FRAME_SIZE=<payload bytes>
+int dataChunkSize = DATA_CHUNK_SIZE;
+
+// Print the CPU time spent by the whole process per MiB transferred
+void printCpuUsage(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpuMs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+                   (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+    double mib = transferBytes / 1048576.0;
+
+    printf("CPU: %.1f ms for %.2f MiB (%.1f ms/MiB, %s path)\n",
+           cpuMs, mib, mib > 0 ? cpuMs / mib : 0.0, useMmap ? "mmap" : "FILE*");
+}
+
+// Write a 64-bit value in big-endian order
+void putU64(unsigned char *buf, uint64_t value)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        buf[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+// Write a 32-bit value in big-endian order
+void putU32(unsigned char *buf, uint32_t value)
+{
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+// Read a 32-bit big-endian value
+uint32_t getU32(const unsigned char *buf)
+{
+    return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 | buf[3];
+}
+
+// Read a 64-bit big-endian value
+uint64_t getU64(const unsigned char *buf)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+// Batch mode: packets are collected in a BUNDLE until the frame is full
+int bundling = FALSE;
+unsigned char bundle[MAX_PAYLOAD_SIZE];
+int bundleSize = 1;
+int bundleCount = 0;
+
+// Send the pending bundle. A lone packet goes out as is.
+int flushBundle(void)
+{
+    int result = 0;
+
+    if (bundleCount == 1)
+        result = llwrite(bundle + 3, bundleSize - 3);
+    else if (bundleCount > 1)
+        result = llwrite(bundle, bundleSize);
+
+    bundle[0] = BUNDLE_PACKET;
+    bundleSize = 1;
+    bundleCount = 0;
+    return result;
+}
+
+// Send the oldest packet of a channel
+void sendFromChannel(Channel *channel)
+{
+    int size;
+    unsigned char *buf = packetQueuePeek(channel->queue, 0, &size);
+
+    if (llwrite(buf, size) == -1)
+    {
+        printf("Maximum tries reached\n");
+        exit(-1);
+    }
+    channelSent(channel, size);
+    packetQueuePop(channel->queue, 1);
+}
+
+// Send the control messages waiting on paths that bypass the scheduler,
+// at most one round of the control channel's weight per file frame
+void serviceControl(void)
+{
+    int size;
+    for (int i = 0; i < CONTROL_WEIGHT && controlActive &&
+                    packetQueuePeek(&controlQueue, 0, &size) != NULL; i++)
+        sendFromChannel(&controlChannel);
+}
+
+// Send one application packet, sharing frames with its neighbours in batch mode
+int emitPacket(const unsigned char *buf, int size)
+{
+    serviceControl();
+    if (!bundling)
+        return llwrite(buf, size);
+
+    if (bundleSize + 2 + size > MAX_PAYLOAD_SIZE && flushBundle() == -1)
+        return -1;
+
+    // Too big to share a frame anyway
+    if (3 + size > MAX_PAYLOAD_SIZE)
+        return llwrite(buf, size);
+
+    bundle[bundleSize] = size >> 8;
+    bundle[bundleSize + 1] = size & 0xFF;
+    memcpy(bundle + bundleSize + 2, buf, size);
+    bundleSize += 2 + size;
+    bundleCount++;
+    return 0;
+}
+
+// Function to send control packet with file information
+int sendCPacket(int fd, unsigned char packetType, const char *name, uint64_t fileSize) 
+{
+    unsigned char buf[MAX_PAYLOAD_SIZE];
+    int size = 1;
+    buf[0] = packetType;
+
+    if (packetType == END_PACKET)
+    {
+        buf[1] = T_HASH;
+        buf[2] = 8;
+        putU64(buf + 3, hashDigest(&txHash));
+        size += 10;
+
+        // Inside a batch the receiver only needs the hash to close the file
+        if (bundling)
+            return emitPacket(buf, size);
+    }
+
+    size_t nameLen = strlen(name);
+    if (nameLen > 255)
+        nameLen = 255;
+
+    // A stream's START leaves the size out, its END carries the final one
+    if (fileSize != UNKNOWN_SIZE)
+    {
+        buf[size] = T_SIZE;
+        buf[size + 1] = 8;
+        putU64(buf + size + 2, fileSize);
+        size += 10;
+    }
+    if (packetType == START_PACKET && deltaTransfer)
+    {
+        buf[size] = T_DELTA;
+        buf[size + 1] = 0;
+        size += 2;
+    }
+    if (packetType == START_PACKET && resumeTransfer)
+    {
+        buf[size] = T_MTIME;
+        buf[size + 1] = 8;
+        putU64(buf + size + 2, sourceMtime);
+        buf[size + 10] = T_RESUME;
+        buf[size + 11] = 0;
+        size += 12;
+    }
+    buf[size] = T_NAME;
+    buf[size + 1] = nameLen;
+    memcpy(buf + size + 2, name, nameLen);
+
+    return emitPacket(buf, size + 2 + nameLen);
+}
+
+// Packets read ahead of the link, so disk stalls do not idle the serial line
+PacketQueue txQueue;
+int readFailed = FALSE; // The reader thread stopped on an I/O error, not at EOF
+
+// Return the realtime clock in nanoseconds, comparable across machines
+// with synchronized clocks
+uint64_t realtimeNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Queue one control message as a CHANNEL packet
+void queueControlMessage(const unsigned char *data, int size)
+{
+    unsigned char *buf = packetQueueReserve(&controlQueue);
+    buf[0] = CHANNEL_PACKET;
+    buf[1] = CONTROL_CHANNEL;
+    putU64(buf + 2, realtimeNs());
+    memcpy(buf + CHANNEL_HEADER_SIZE, data, size);
+    packetQueuePush(&controlQueue, CHANNEL_HEADER_SIZE + size);
+}
+
+// Control thread: reads the command stream and queues one message per line
+void *controlThread(void *arg)
+{
+    const char *path = arg;
+    unsigned char line[MAX_PAYLOAD_SIZE - CHANNEL_HEADER_SIZE];
+    int length = 0;
+
+    // Non-blocking, so a FIFO without a writer yet does not hold up the end
+    // of the session
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+    {
+        perror(path);
+        packetQueueClose(&controlQueue);
+        return NULL;
+    }
+
+    unsigned char buf[4096];
+    ssize_t bytesRead;
+    int stopping = FALSE;
+    struct pollfd fds[2] = {{fd, POLLIN, 0}, {controlStop[0], POLLIN, 0}};
+    while (1)
+    {
+        // Once stopped, only take what the writer already sent
+        if (!stopping && poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents != 0)
+            stopping = TRUE;
+
+        bytesRead = read(fd, buf, sizeof(buf));
+        if (bytesRead == 0 || (bytesRead == -1 && errno == EAGAIN && stopping))
+            break;
+        if (bytesRead == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (bytesRead == -1)
+            break;
+
+        for (ssize_t i = 0; i < bytesRead; i++)
+        {
+            line[length++] = buf[i];
+            if (buf[i] == '\n' || length == (int)sizeof(line))
+            {
+                queueControlMessage(line, length);
+                length = 0;
+            }
+        }
+    }
+    if (length > 0)
+        queueControlMessage(line, length);
+
+    close(fd);
+    packetQueueClose(&controlQueue);
+    return NULL;
+}
+
+// Set up the channels of a transmitter session
+void startChannels(void)
+{
+    const char *control = getenv("APP_CONTROL");
+
+    scheduler.count = 0;
+    channelInit(&fileChannel, 0, "file", &txQueue, 1, 1);
+    schedulerAdd(&scheduler, &fileChannel);
+
+    if (control == NULL)
+        return;
+
+    packetQueueInit(&controlQueue);
+    channelInit(&controlChannel, CONTROL_CHANNEL, "control", &controlQueue, 0, CONTROL_WEIGHT);
+    schedulerAdd(&scheduler, &controlChannel);
+
+    if (pipe(controlStop) == -1 ||
+        pthread_create(&controlId, NULL, controlThread, (void *)control) != 0)
+    {
+        perror("Starting the control channel");
+        scheduler.count = 1;
+        return;
+    }
+    controlActive = TRUE;
+}
+
+// Stop the control thread and send every message it queued. Called before
+// the packet that ends the session, the receiver stops listening after it.
+void stopChannels(void)
+{
+    if (!controlActive)
+        return;
+
+    if (write(controlStop[1], "", 1) == -1)
+        perror("Stopping the control channel");
+
+    // Drained until the thread closes the queue, it may be waiting for room
+    while (packetQueueWait(&controlQueue, 1) > 0)
+        sendFromChannel(&controlChannel);
+    pthread_join(controlId, NULL);
+    close(controlStop[0]);
+    close(controlStop[1]);
+    controlActive = FALSE;
+}
+
+// Read up to "size" bytes of the source. A stream returns whatever the pipe
+// holds instead of waiting for a full buffer.
+ssize_t readSource(FILE *f, unsigned char *buf, size_t size)
+{
+    if (!streamInput)
+        return fread(buf, 1, size, f);
+
+    ssize_t bytesRead;
+    do
+        bytesRead = read(fileno(f), buf, size);
+    while (bytesRead == -1 && errno == EINTR);
+    return bytesRead;
+}
+
+// Reader thread: fills the transmit queue with ready DATA packets
+void *readerThread(void *arg)
+{
+    FILE *f = arg;
+    ssize_t bytesRead = 0;
+    uint64_t offset = resumeOffset;
+
+    // Ask the kernel for aggressive readahead on the source file
+    posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (1)
+    {
+        unsigned char *buf = packetQueueReserve(&txQueue);
+        bytesRead = readSource(f, buf + DATA_HEADER_SIZE, dataChunkSize);
+        if (bytesRead <= 0)
+            break;
+
+        buf[0] = DATA_PACKET;
+        putU64(buf + 1, offset);
+        buf[9] = bytesRead / 256;
+        buf[10] = bytesRead % 256;
+
+        // Hashed here so the link thread never pays for it
+        hashUpdate(&txHash, buf + DATA_HEADER_SIZE, bytesRead);
+        packetQueuePush(&txQueue, bytesRead + DATA_HEADER_SIZE);
+        offset += bytesRead;
+    }
+
+    // fread reports an error as a short count, just like EOF
+    if (bytesRead < 0 || ferror(f))
+    {
+        perror("Reading the source");
+        readFailed = TRUE;
+    }
+
+    transferBytes += offset - resumeOffset;
+    packetQueueClose(&txQueue);
+    return NULL;
+}
+
+// Pool work: turn a raw chunk into a record, stored as is when LZ does not
+// make it smaller (already compressed data such as GIFs)
+void compressChunk(Chunk *chunk)
+{
+    unsigned char *record = chunk->out;
+    int size = lzCompress(chunk->in, chunk->inSize, record + CHUNK_HEADER_SIZE);
+
+    if (size >= chunk->inSize)
+    {
+        memcpy(record + CHUNK_HEADER_SIZE, chunk->in, chunk->inSize);
+        size = chunk->inSize;
+    }
+
+    putU64(record, chunk->offset);
+    putU32(record + 8, chunk->inSize);
+    putU32(record + 12, size);
+    chunk->outSize = CHUNK_HEADER_SIZE + size;
+}
+
+// Pool work: turn a received record back into raw bytes
+void decompressChunk(Chunk *chunk)
+{
+    int rawSize = getU32(chunk->in + 8);
+    int storedSize = getU32(chunk->in + 12);
+
+    if (storedSize == rawSize)
+    {
+        memcpy(chunk->out, chunk->in + CHUNK_HEADER_SIZE, rawSize);
+        chunk->outSize = rawSize;
+    }
+    else if (lzDecompress(chunk->in + CHUNK_HEADER_SIZE, storedSize, chunk->out, CHUNK_SIZE) == rawSize)
+    {
+        chunk->outSize = rawSize;
+    }
+    else
+    {
+        chunk->outSize = -1;
+    }
+    chunk->offset = getU64(chunk->in);
+}
+
+// Start the worker pool the first time it is needed
+int startChunkPool(ChunkWork work)
+{
+    if (chunkPoolStarted)
+        return 0;
+    if (chunkPoolInit(&chunkPool, work, chunkPoolDefaultWorkers()) == -1)
+        return -1;
+    chunkPoolStarted = TRUE;
+    return 0;
+}
+
+// ZDATA packet being filled by the compressor thread
+unsigned char *zPacket = NULL;
+int zPacketSize = 0;
+uint64_t zStreamOffset = 0;
+
+// Publish the ZDATA packet being filled
+void flushZPacket(void)
+{
+    if (zPacket == NULL)
+        return;
+
+    int length = zPacketSize - DATA_HEADER_SIZE;
+    zPacket[9] = length / 256;
+    zPacket[10] = length % 256;
+    packetQueuePush(&txQueue, zPacketSize);
+    zPacket = NULL;
+}
+
+// Append record bytes to the compressed stream. Packets are filled across
+// record boundaries, so a small record does not cost a frame of its own.
+void appendZStream(const unsigned char *data, int size)
+{
+    while (size > 0)
+    {
+        if (zPacket == NULL)
+        {
+            zPacket = packetQueueReserve(&txQueue);
+            zPacket[0] = ZDATA_PACKET;
+            putU64(zPacket + 1, zStreamOffset);
+            zPacketSize = DATA_HEADER_SIZE;
+        }
+
+        int length = MAX_PAYLOAD_SIZE - zPacketSize;
+        if (length > size)
+            length = size;
+        memcpy(zPacket + zPacketSize, data, length);
+        zPacketSize += length;
+        zStreamOffset += length;
+        data += length;
+        size -= length;
+
+        if (zPacketSize == MAX_PAYLOAD_SIZE)
+            flushZPacket();
+    }
+}
+
+// Compressor thread: reads chunks, has the pool compress them and queues
+// the records, in order, as ZDATA packets
+void *compressorThread(void *arg)
+{
+    FILE *f = arg;
+    uint64_t offset = resumeOffset;
+    int eof = FALSE;
+
+    posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+    zPacket = NULL;
+    zStreamOffset = 0;
+
+    while (1)
+    {
+        // Keep every worker busy by reading ahead while chunks are free. A
+        // stream first sends what it has, the next read may block for long.
+        Chunk *chunk = NULL;
+        if (!eof && !(streamInput && chunkPoolPending(&chunkPool) > 0))
+            chunk = chunkPoolAcquire(&chunkPool);
+        if (chunk != NULL)
+        {
+            ssize_t bytesRead = readSource(f, chunk->in, CHUNK_SIZE);
+            if (bytesRead <= 0)
+            {
+                if (bytesRead < 0 || ferror(f))
+                {
+                    perror("Reading the source");
+                    readFailed = TRUE;
+                }
+                eof = TRUE;
+                continue;
+            }
+
+            hashUpdate(&txHash, chunk->in, bytesRead);
+            chunk->inSize = bytesRead;
+            chunk->offset = offset;
+            offset += bytesRead;
+            chunkPoolSubmit(&chunkPool);
+            continue;
+        }
+
+        chunk = chunkPoolCollect(&chunkPool);
+        if (chunk == NULL)
+            break;
+
+        chunks++;
+        if (chunk->outSize - CHUNK_HEADER_SIZE == chunk->inSize)
+            storedChunks++;
+        chunkRawBytes += chunk->inSize;
+        chunkStreamBytes += chunk->outSize;
+
+        appendZStream(chunk->out, chunk->outSize);
+        chunkPoolRelease(&chunkPool);
+
+        // Nothing else ready, do not hold back the bytes already compressed
+        if (streamInput && chunkPoolPending(&chunkPool) == 0)
+            flushZPacket();
+    }
+
+    flushZPacket();
+    transferBytes += offset - resumeOffset;
+    packetQueueClose(&txQueue);
+    return NULL;
+}
+
+// Print how much the compression stage saved
+void printCompressionStats(void)
+{
+    if (chunks == 0)
+        return;
+
+    printf("Compression: %llu -> %llu bytes (%.2fx), %llu chunks, %llu stored raw, %d workers\n",
+           (unsigned long long)chunkRawBytes, (unsigned long long)chunkStreamBytes,
+           chunkStreamBytes ? (double)chunkRawBytes / chunkStreamBytes : 0.0,
+           chunks, storedChunks, chunkPool.workerCount);
+}
+
+// Send the file straight from a read-only mapping, no fread copies
+int sendDPacketMapped(int fd, int file, uint64_t fileSize)
+{
+    if (fileSize == 0)
+        return 0;
+
+    unsigned char *map = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, file, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    madvise(map, fileSize, MADV_SEQUENTIAL);
+
+    // Slices of the mapping go to the link layer next to their DATA header
+    unsigned char header[DATA_HEADER_SIZE];
+    for (uint64_t offset = resumeOffset; offset < fileSize; offset += dataChunkSize)
+    {
+        size_t length = fileSize - offset < dataChunkSize ? fileSize - offset : dataChunkSize;
+
+        header[0] = DATA_PACKET;
+        putU64(header + 1, offset);
+        header[9] = length / 256;
+        header[10] = length % 256;
+
+        hashUpdate(&txHash, map + offset, length);
+        if (llwritev(header, DATA_HEADER_SIZE, map + offset, length) == -1)
+        {
+            printf("Maximum tries reached\n");
+            exit(-1);
+        }
+    }
+
+    transferBytes += fileSize - resumeOffset;
+    munmap(map, fileSize);
+    return 0;
+}
+
+// Function to send data packets with file content
+int sendDPacket(int fd, FILE *f, uint64_t fileSize) 
+{
+    if (useCompress && startChunkPool(compressChunk) == -1)
+        useCompress = FALSE;
+    if (useMmap && !streamInput && !useCompress && !controlActive)
+        return sendDPacketMapped(fd, fileno(f), fileSize);
+
+    packetQueueInit(&txQueue);
+    readFailed = FALSE;
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, useCompress ? compressorThread : readerThread, f) != 0)
+    {
+        perror("pthread_create");
+        return -1;
+    }
+
+    // The link thread only drains packets prepared by the reader and the
+    // control thread, picking the next one at every frame boundary
+    Channel *channel;
+    while ((channel = schedulerNext(&scheduler, &fileChannel)) != NULL)
+        sendFromChannel(channel);
+
+    // Commands already queued still go out before the file's END
+    int size;
+    while (controlActive && packetQueuePeek(&controlQueue, 0, &size) != NULL)
+        sendFromChannel(&controlChannel);
+
+    pthread_join(reader, NULL);
+    return readFailed ? -1 : 0;
+}
+
+// Send a small file as DATA packets that may share frames with other files.
+// Each piece is cut to the room left in the bundle, so frames go out full
+// across file boundaries.
+int sendSmallDPackets(int fd, FILE *f)
+{
+    unsigned char buf[MAX_PAYLOAD_SIZE];
+    size_t bytesRead = 0;
+    uint64_t offset = 0;
+
+    while (1)
+    {
+        int room = MAX_PAYLOAD_SIZE - bundleSize - 2 - DATA_HEADER_SIZE;
+        if (room < MIN_BUNDLED_DATA)
+        {
+            if (flushBundle() == -1)
+            {
+                printf("Maximum tries reached\n");
+                exit(-1);
+            }
+            room = MAX_PAYLOAD_SIZE - bundleSize - 2 - DATA_HEADER_SIZE;
+        }
+        if (room > dataChunkSize)
+            room = dataChunkSize;
+
+        bytesRead = fread(buf + DATA_HEADER_SIZE, 1, room, f);
+        if (bytesRead == 0)
+            break;
+
+        buf[0] = DATA_PACKET;
+        putU64(buf + 1, offset);
+        buf[9] = bytesRead / 256;
+        buf[10] = bytesRead % 256;
+
+        hashUpdate(&txHash, buf + DATA_HEADER_SIZE, bytesRead);
+        if (emitPacket(buf, bytesRead + DATA_HEADER_SIZE) == -1)
+        {
+            printf("Maximum tries reached\n");
+            exit(-1);
+        }
+        offset += bytesRead;
+    }
+
+    transferBytes += offset;
+    if (ferror(f))
+    {
+        perror("Reading the source");
+        return -1;
+    }
+    return 0;
+}
+
+// Delta references not sent yet, merged while they stay contiguous
+uint64_t refDest = 0, refSource = 0, refLength = 0;
+uint64_t literalBytes = 0, copiedBytes = 0;
+unsigned long long references = 0;
+
+// Send the pending reference to the receiver's old copy
+void flushReference(void)
+{
+    if (refLength == 0)
+        return;
+
+    unsigned char buf[REF_PACKET_SIZE];
+    buf[0] = REF_PACKET;
+    putU64(buf + 1, refDest);
+    putU64(buf + 9, refSource);
+    putU32(buf + 17, refLength);
+    if (llwrite(buf, REF_PACKET_SIZE) == -1)
+    {
+        printf("Maximum tries reached\n");
+        exit(-1);
+    }
+
+    copiedBytes += refLength;
+    references++;
+    refLength = 0;
+}
+
+// Copy "length" bytes at "source" of the old copy to "dest" of the new file
+void addReference(uint64_t dest, uint64_t source, uint64_t length)
+{
+    if (refLength > 0 && refDest + refLength == dest && refSource + refLength == source &&
+        refLength + length <= UINT32_MAX)
+    {
+        refLength += length;
+        return;
+    }
+
+    flushReference();
+    refDest = dest;
+    refSource = source;
+    refLength = length;
+}
+
+// Send bytes the receiver does not have as plain DATA packets
+void sendLiterals(const unsigned char *map, uint64_t start, uint64_t end)
+{
+    unsigned char header[DATA_HEADER_SIZE];
+
+    if (start < end)
+        flushReference();
+
+    for (uint64_t offset = start; offset < end; offset += dataChunkSize)
+    {
+        size_t length = end - offset < dataChunkSize ? end - offset : dataChunkSize;
+
+        header[0] = DATA_PACKET;
+        putU64(header + 1, offset);
+        header[9] = length / 256;
+        header[10] = length % 256;
+
+        serviceControl();
+        if (llwritev(header, DATA_HEADER_SIZE, map + offset, length) == -1)
+        {
+            printf("Maximum tries reached\n");
+            exit(-1);
+        }
+    }
+    literalBytes += end - start;
+}
+
+// Read the signature the receiver sends back after a delta START. The link
+// is half duplex, so the two ends simply swap llwrite and llread; the link
+// layer copes with a lost RR at either swap.
+BlockSignature *receiveSignature(int *count, size_t *blockSize)
+{
+    unsigned char buf[PACKET_SLOT_SIZE];
+    BlockSignature *blocks = NULL;
+    int total = -1, received = 0;
+
+    while (total < 0 || received < total)
+    {
+        int size = llread(buf);
+        if (size < SIGNATURE_HEADER_SIZE || buf[0] != SIGNATURE_PACKET)
+            continue;
+
+        if (blocks == NULL)
+        {
+            *blockSize = getU32(buf + 1);
+            total = getU32(buf + 5);
+            blocks = malloc((total > 0 ? total : 1) * sizeof(BlockSignature));
+            if (blocks == NULL)
+                return NULL;
+        }
+
+        uint32_t first = getU32(buf + 9);
+        for (int i = SIGNATURE_HEADER_SIZE; i + SIGNATURE_ENTRY_SIZE <= size; i += SIGNATURE_ENTRY_SIZE)
+        {
+            if (first >= (uint32_t)total)
+                break;
+            blocks[first].weak = getU32(buf + i);
+            blocks[first].strong = getU64(buf + i + 4);
+            first++;
+            received++;
+        }
+    }
+
+    *count = total;
+    return blocks;
+}
+
+// Send a file as literal DATA plus references to blocks of the receiver's
+// old copy, found with a rolling checksum at every byte offset
+int sendDelta(int fd, FILE *f, uint64_t fileSize)
+{
+    int count;
+    size_t blockSize;
+    BlockSignature *blocks = receiveSignature(&count, &blockSize);
+    SignatureIndex index;
+    if (blocks == NULL || signatureIndexBuild(&index, blocks, count, blockSize) == -1)
+    {
+        printf("Out of memory for the delta signature\n");
+        exit(-1);
+    }
+    printf("Signature: %d blocks of %zu bytes\n", count, blockSize);
+
+    unsigned char *map = NULL;
+    if (fileSize > 0)
+    {
+        map = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (map == MAP_FAILED)
+        {
+            perror("mmap");
+            signatureIndexFree(&index);
+            free(blocks);
+            return -1;
+        }
+        madvise(map, fileSize, MADV_SEQUENTIAL);
+    }
+
+    uint64_t pos = 0, literalStart = 0;
+    int prefer = -1;
+    RollingSum sum;
+    if (count > 0 && fileSize >= blockSize)
+        rollingInit(&sum, map, blockSize);
+
+    while (count > 0 && pos + blockSize <= fileSize)
+    {
+        int block = signatureIndexFind(&index, rollingDigest(&sum), map + pos, prefer);
+        if (block >= 0)
+        {
+            sendLiterals(map, literalStart, pos);
+            addReference(pos, (uint64_t)block * blockSize, blockSize);
+            pos += blockSize;
+            literalStart = pos;
+            prefer = block + 1;
+            if (pos + blockSize <= fileSize)
+                rollingInit(&sum, map + pos, blockSize);
+            continue;
+        }
+
+        if (pos + blockSize < fileSize)
+            rollingRotate(&sum, map[pos], map[pos + blockSize]);
+        pos++;
+
+        // Do not let a long changed region pile up
+        if (pos - literalStart == dataChunkSize)
+        {
+            sendLiterals(map, literalStart, pos);
+            literalStart = pos;
+        }
+    }
+    sendLiterals(map, literalStart, fileSize);
+    flushReference();
+
+    hashUpdate(&txHash, map, fileSize);
+    transferBytes += fileSize;
+    printf("Delta: %llu literal bytes, %llu bytes in %llu references\n",
+           (unsigned long long)literalBytes, (unsigned long long)copiedBytes, references);
+
+    if (map != NULL)
+        munmap(map, fileSize);
+    signatureIndexFree(&index);
+    free(blocks);
+    return 0;
+}
+
+// Wait for the receiver's answer to a resumable START and skip what it
+// already has. The skipped bytes are still hashed, so END covers the file.
+// As with the delta signature, the two ends swap llwrite and llread here and
+// again once the offset is through.
+int resumeSource(FILE *f, uint64_t fileSize)
+{
+    unsigned char buf[PACKET_SLOT_SIZE];
+    int size;
+
+    do
+        size = llread(buf);
+    while (size < RESUME_PACKET_SIZE || buf[0] != RESUME_PACKET);
+
+    uint64_t offset = getU64(buf + 1);
+    if (offset == 0 || offset > fileSize)
+        return 0;
+
+    printf("Resuming at byte %llu of %llu\n", (unsigned long long)offset, (unsigned long long)fileSize);
+
+    // Leaves the file positioned at the resume offset
+    unsigned char block[CHUNK_SIZE];
+    for (uint64_t done = 0; done < offset;)
+    {
+        size_t n = offset - done < CHUNK_SIZE ? offset - done : CHUNK_SIZE;
+        if (fread(block, 1, n, f) != n)
+            return -1;
+        hashUpdate(&txHash, block, n);
+        done += n;
+    }
+
+    resumeOffset = offset;
+    return 0;
+}
+
+// Send one file as START, DATA and END packets, opening it only once.
+// "-" reads standard input.
+int sendFile(int fd, const char *path, const char *name)
+{
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (f == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    // Pipes, terminals and devices have no size up front
+    struct stat st;
+    if (fstat(fileno(f), &st) == -1)
+    {
+        perror(path);
+        fclose(f);
+        return -1;
+    }
+    streamInput = !S_ISREG(st.st_mode);
+    uint64_t fileSize = streamInput ? UNKNOWN_SIZE : (uint64_t)st.st_size;
+    uint64_t sentBefore = transferBytes;
+    hashInit(&txHash, 0);
+    deltaTransfer = useDelta && !streamInput && !bundling;
+    resumeTransfer = useResume && !streamInput && !bundling && !deltaTransfer;
+    sourceMtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    resumeOffset = 0;
+
+    if (sendCPacket(fd, START_PACKET, name, fileSize) == -1 ||
+        (resumeTransfer && resumeSource(f, fileSize) == -1))
+    {
+        fclose(f);
+        return -1;
+    }
+
+    int result;
+    if (bundling && fileSize <= SMALL_FILE_SIZE)
+        result = sendSmallDPackets(fd, f);
+    else if (flushBundle() == -1) // Large files go in frames of their own
+        result = -1;
+    else if (deltaTransfer)
+        result = sendDelta(fd, f, fileSize);
+    else
+        result = sendDPacket(fd, f, fileSize);
+
+    fclose(f);
+    // No END: its size and hash would describe a truncated file
+    if (result == -1)
+        return -1;
+
+    if (!bundling)
+    {
+        printf("Hash: %016llx\n", (unsigned long long)hashDigest(&txHash));
+        stopChannels();
+    }
+    return sendCPacket(fd, END_PACKET, name, resumeOffset + transferBytes - sentBefore);
+}
+
+// Keep regular files only when listing a batch directory
+int isRegularFile(const struct dirent *entry)
+{
+    return entry->d_type == DT_REG || entry->d_type == DT_UNKNOWN;
+}
+
+// Send every regular file of a directory in one link session
+int sendBatch(int fd, const char *dirPath)
+{
+    struct dirent **list;
+    int n = scandir(dirPath, &list, isRegularFile, alphasort);
+    if (n < 0)
+    {
+        perror(dirPath);
+        return -1;
+    }
+
+    // First pass: drop anything that is not a regular file and total the sizes
+    char path[PATH_MAX];
+    uint64_t count = 0, total = 0;
+    for (int i = 0; i < n; i++)
+    {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dirPath, list[i]->d_name);
+        if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+        {
+            free(list[i]);
+            list[i] = NULL;
+            continue;
+        }
+        count++;
+        total += st.st_size;
+    }
+
+    printf("Sending %llu files, %llu bytes\n", (unsigned long long)count, (unsigned long long)total);
+
+    unsigned char manifest[21];
+    manifest[0] = MANIFEST_PACKET;
+    manifest[1] = T_COUNT;
+    manifest[2] = 8;
+    putU64(manifest + 3, count);
+    manifest[11] = T_SIZE;
+    manifest[12] = 8;
+    putU64(manifest + 13, total);
+
+    // MANIFEST and BATCH_END travel in frames of their own, the receiver's
+    // link thread looks for them to delimit the session
+    int result = llwrite(manifest, sizeof(manifest));
+
+    bundling = TRUE;
+    bundleSize = 1;
+    bundleCount = 0;
+    bundle[0] = BUNDLE_PACKET;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (list[i] == NULL)
+            continue;
+        if (result != -1)
+        {
+            snprintf(path, sizeof(path), "%s/%s", dirPath, list[i]->d_name);
+            result = sendFile(fd, path, list[i]->d_name);
+        }
+        free(list[i]);
+    }
+    free(list);
+
+    if (result != -1)
+        result = flushBundle();
+    bundling = FALSE;
+    if (result != -1)
+        stopChannels();
+
+    unsigned char end = BATCH_END_PACKET;
+    if (result != -1)
+        result = llwrite(&end, 1);
+    return result;
+}
+
+// Find a TLV of a control packet. Return its length and point "value" at
+// it, or return -1 when the packet does not have it.
+int findTLV(const unsigned char *buf, int size, unsigned char type, const unsigned char **value)
+{
+    int i = 1;
+
+    while (i + 2 <= size)
+    {
+        unsigned char length = buf[i + 1];
+        if (i + 2 + length > size)
+            break;
+        if (buf[i] == type)
+        {
+            *value = buf + i + 2;
+            return length;
+        }
+        i += 2 + length;
+    }
+    return -1;
+}
+
+// Extract the size and name TLVs from a START/END packet. Return
+// UNKNOWN_SIZE when the packet has no size.
+uint64_t parseCPacket(const unsigned char *buf, int size, char *name, int nameSize)
+{
+    const unsigned char *value;
+    int length;
+
+    name[0] = '\0';
+    length = findTLV(buf, size, T_NAME, &value);
+    if (length >= 0 && length < nameSize)
+    {
+        memcpy(name, value, length);
+        name[length] = '\0';
+    }
+
+    if (findTLV(buf, size, T_SIZE, &value) == 8)
+        return getU64(value);
+    return UNKNOWN_SIZE;
+}
+
+// Receiver writes are gathered up to this file alignment
+#define WRITE_ALIGN 65536
+#define WRITE_IOV_MAX 64
+
+// When the receiver syncs the output file to disk, set with APP_FSYNC
+typedef enum
+{
+    FsyncNone,     // Leave it to the kernel (default)
+    FsyncEnd,      // "end": once, after the last DATA packet
+    FsyncInterval, // "<n>": every n MiB and at the end
+} FsyncPolicy;
+
+// Receive-side writer stage, fed by the link thread through rxQueue. It
+// handles every packet in order, so opening and closing files never races
+// with their DATA.
+typedef struct
+{
+    const char *outputPath; // Output file, or directory in batch mode
+    int batch;
+    int fd;                 // Current output file, -1 between files
+    int seekable;           // FALSE for pipes and terminals, written in order
+    uint64_t fileSize;      // Size announced in START (or END for a stream)
+    uint64_t received;      // Highest offset written for the current file
+    HashState hash;         // Contents of the current file, in offset order
+    uint64_t hashed;        // Bytes fed to the hash so far
+    uint64_t zReceived;     // Compressed stream bytes received (ZDATA)
+    Chunk *zChunk;          // Chunk record being reassembled, NULL if none
+    int zFill;
+    int baseFd;             // Old copy that REF packets read from, -1 if none
+    char deltaPath[PATH_MAX + 8]; // New copy being built next to it, "" if no delta
+    int journalFd;          // Checkpoint journal of a resumable file, -1 if none
+    char journalPath[PATH_MAX + 8];
+    uint64_t sourceMtime;
+    uint64_t journalled;    // Confirmed bytes recorded in the journal
+    uint64_t totalReceived;
+    unsigned long long files;
+    unsigned long long hashChecked;
+    unsigned long long hashMismatches;
+    FsyncPolicy fsyncPolicy;
+    uint64_t fsyncInterval;
+    uint64_t sinceSync;
+    unsigned long long writes;
+    unsigned long long bytesWritten;
+    int failed;
+    unsigned char *map; // Output mapping in APP_MMAP mode, replaces the thread
+    uint64_t mapSize;
+} FileWriter;
+
+PacketQueue rxQueue;
+FileWriter writer;
+
+// Receiver's original standard output when the filename is "-"
+int stdoutFd = -1;
+
+// Keep the real standard output for file data and send everything printed
+// to stderr instead. main() prints its banner first, but stdio only flushes
+// it to a pipe later, so it ends up on stderr too.
+void detachStdout(void)
+{
+    stdoutFd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+// Feed payload bytes to the file hash. Frames arrive in order, so a
+// duplicate only needs its new part hashed.
+void hashPayload(FileWriter *w, uint64_t offset, const unsigned char *data, size_t size)
+{
+    if (offset + size <= w->hashed || offset > w->hashed)
+        return;
+
+    size_t done = w->hashed - offset;
+    hashUpdate(&w->hash, data + done, size - done);
+    w->hashed += size - done;
+}
+
+// Write a gathered run of payloads at "offset". Outputs that cannot seek
+// take the bytes in order, possibly over several calls.
+int writeOutput(FileWriter *w, struct iovec *iov, int count, uint64_t offset)
+{
+    if (w->seekable)
+    {
+        size_t total = 0;
+        for (int i = 0; i < count; i++)
+            total += iov[i].iov_len;
+        return pwritev(w->fd, iov, count, offset) == (ssize_t)total ? 0 : -1;
+    }
+
+    // Link frames arrive in order, so a stream can only go wrong on a lost END
+    if (offset != w->received)
+    {
+        fprintf(stderr, "Stream gap at byte %llu\n", (unsigned long long)offset);
+        errno = ESPIPE;
+        return -1;
+    }
+
+    while (count > 0)
+    {
+        ssize_t written = writev(w->fd, iov, count);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written == -1)
+            return -1;
+
+        // Skip what went out and retry the rest
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (unsigned char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Read the fsync policy from the environment
+void parseFsyncPolicy(FileWriter *w)
+{
+    const char *policy = getenv("APP_FSYNC");
+    w->fsyncPolicy = FsyncNone;
+
+    if (policy == NULL)
+        return;
+    if (strcmp(policy, "end") == 0)
+    {
+        w->fsyncPolicy = FsyncEnd;
+    }
+    else if (atoi(policy) > 0)
+    {
+        w->fsyncPolicy = FsyncInterval;
+        w->fsyncInterval = (uint64_t)atoi(policy) << 20;
+    }
+}
+
+// Write a run of queued DATA frames, coalescing contiguous payloads into one
+// aligned pwritev call. "skip" counts bytes of the oldest frame already
+// written. Return the number of frames fully written.
+int writeCoalesced(FileWriter *w, size_t *skip)
+{
+    struct iovec iov[WRITE_IOV_MAX];
+    int iovCount = 0, used = 0, size;
+    size_t nextSkip = 0;
+
+    unsigned char *buf = packetQueuePeek(&rxQueue, 0, &size);
+    uint64_t start = getU64(buf + 1) + *skip;
+    uint64_t end = start;
+    uint64_t boundary = (start / WRITE_ALIGN + 1) * WRITE_ALIGN;
+
+    // Gather payloads until the next aligned boundary or a gap in the offsets
+    while (iovCount < WRITE_IOV_MAX)
+    {
+        buf = packetQueuePeek(&rxQueue, used, &size);
+        if (buf == NULL)
+        {
+            // Keep waiting only while the link thread has room left. A
+            // stream writes what it has, its reader may be waiting for it.
+            if (!w->seekable || used >= PACKET_QUEUE_DEPTH / 2 ||
+                packetQueueWait(&rxQueue, used + 1) <= used)
+                break;
+            buf = packetQueuePeek(&rxQueue, used, &size);
+        }
+
+        // Control packets are handled one at a time by the caller
+        if (buf[0] != DATA_PACKET)
+            break;
+
+        size_t done = (used == 0) ? *skip : 0;
+        uint64_t offset = getU64(buf + 1) + done;
+        size_t length = buf[9] * 256 + buf[10] - done;
+        if (offset != end)
+            break;
+
+        // Split a payload that crosses the boundary, the rest goes in the next write
+        if (end + length > boundary)
+        {
+            length = boundary - end;
+            nextSkip = done + length;
+        }
+
+        iov[iovCount].iov_base = buf + DATA_HEADER_SIZE + done;
+        iov[iovCount].iov_len = length;
+        iovCount++;
+        end += length;
+
+        if (nextSkip > 0)
+            break;
+        used++;
+        if (end == boundary)
+            break;
+    }
+
+    uint64_t position = start;
+    for (int i = 0; i < iovCount; i++)
+    {
+        hashPayload(w, position, iov[i].iov_base, iov[i].iov_len);
+        position += iov[i].iov_len;
+    }
+
+    if (writeOutput(w, iov, iovCount, start) == -1)
+    {
+        perror("write");
+        w->failed = TRUE;
+    }
+    w->writes++;
+    w->bytesWritten += end - start;
 
-struct applicationLayer
-{
-int fileDescriptor; /*Descritor correspondente à porta série*/
-int status; /*TRANSMITTER | RECEIVER*/
-};
+    w->sinceSync += end - start;
+    if (w->fsyncPolicy == FsyncInterval && w->sinceSync >= w->fsyncInterval && w->seekable)
+    {
+        fdatasync(w->fd);
+        w->sinceSync = 0;
+    }
 
-#define END_PACKET 0x03
-#define START_PACKET 0x02
-#define DATA_PACKET 0x01
+    if (end > w->received)
+        w->received = end;
+    *skip = nextSkip;
+    return used;
+}
 
-// Function to send control packet with file information
-int sendCPacket(int fd, unsigned char packetType, const char *filename) 
+// Preallocate the output file and map it, the size comes from the START packet
+int mapOutputFile(FileWriter *w, uint64_t fileSize)
 {
-    FILE *f = fopen(filename, "rb");
-    fseek(f, 0L, SEEK_END);
-    int sizeF = ftell(f);
-    fclose(f);
-    unsigned char buf[1024];
-    unsigned char b3 = sizeF >> 8;
-    unsigned char b4 = (unsigned char)sizeF;
-    
-    buf[0] = packetType;
-    buf[1] = 0x00;
-    buf[2] = 0x02;
-    buf[3] = b3;
-    buf[4] = b4;
-    buf[5] = 0x01;
-    buf[6] = strlen(filename);
-    
-    memcpy(buf + 7, filename, strlen(filename));
-    llwrite(buf,strlen(filename) + 7);
-    
+    // posix_fallocate fails on filesystems without support, ftruncate still sizes the file
+    posix_fallocate(w->fd, 0, fileSize);
+    if (ftruncate(w->fd, fileSize) == -1)
+    {
+        perror("ftruncate");
+        return -1;
+    }
+
+    w->map = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+    if (w->map == MAP_FAILED)
+    {
+        perror("mmap");
+        w->map = NULL;
+        return -1;
+    }
+    madvise(w->map, fileSize, MADV_SEQUENTIAL);
+    w->mapSize = fileSize;
     return 0;
 }
 
-// Function to send data packets with file content
-int sendDPacket(int fd, const char *filename) 
+// Copy a DATA payload into the output mapping
+void writeMapped(FileWriter *w, uint64_t offset, const unsigned char *data, size_t size)
 {
-    FILE *f = fopen(filename, "rb");
-    unsigned char buf[MAX_PAYLOAD_SIZE + 4];
-    unsigned int bytesRead = 0;
-    int packetNumber = 0;
+    if (offset + size > w->mapSize)
+    {
+        w->failed = TRUE;
+        return;
+    }
 
-    while ((bytesRead = fread(buf + 4, 1, MAX_PAYLOAD_SIZE, f)) > 0) 
+    memcpy(w->map + offset, data, size);
+    hashPayload(w, offset, data, size);
+    w->writes++;
+    w->bytesWritten += size;
+
+    // Start writeback without waiting for it
+    w->sinceSync += size;
+    if (w->fsyncPolicy == FsyncInterval && w->sinceSync >= w->fsyncInterval)
     {
-        buf[0] = DATA_PACKET;
-        buf[1] = packetNumber;
-        buf[2] = bytesRead / 256;
-        buf[3] = bytesRead % 256;
+        msync(w->map, w->mapSize, MS_ASYNC);
+        w->sinceSync = 0;
+    }
+}
+
+// Write one payload at its file offset. Writing by offset makes duplicated
+// or reordered packets harmless.
+void writePayload(FileWriter *w, uint64_t offset, const unsigned char *data, size_t size)
+{
+    if (w->map != NULL)
+    {
+        writeMapped(w, offset, data, size);
+    }
+    else
+    {
+        struct iovec iov = {(void *)data, size};
+        hashPayload(w, offset, data, size);
+        if (writeOutput(w, &iov, 1, offset) == -1)
+        {
+            perror("write");
+            w->failed = TRUE;
+        }
+        w->writes++;
+        w->bytesWritten += size;
+    }
+    if (offset + size > w->received)
+        w->received = offset + size;
+}
+
+// Write the oldest chunk the decompression pool has in flight. Return
+// FALSE when there is none.
+int collectChunk(FileWriter *w)
+{
+    Chunk *chunk = chunkPoolStarted ? chunkPoolCollect(&chunkPool) : NULL;
+    if (chunk == NULL)
+        return FALSE;
+
+    if (chunk->outSize < 0)
+    {
+        printf("Corrupt compressed chunk at byte %llu\n", (unsigned long long)chunk->offset);
+        w->failed = TRUE;
+    }
+    else
+    {
+        writePayload(w, chunk->offset, chunk->out, chunk->outSize);
+        chunks++;
+        if (getU32(chunk->in + 12) == (uint32_t)chunk->outSize)
+            storedChunks++;
+        chunkRawBytes += chunk->outSize;
+        chunkStreamBytes += CHUNK_HEADER_SIZE + getU32(chunk->in + 12);
+    }
+    chunkPoolRelease(&chunkPool);
+    return TRUE;
+}
+
+// Write every chunk still being decompressed
+void drainChunks(FileWriter *w)
+{
+    while (collectChunk(w))
+        ;
+}
+
+// Record the contiguous bytes written so far in the journal, once they are
+// on disk. "force" skips the interval, otherwise it runs every JOURNAL_INTERVAL.
+void checkpoint(FileWriter *w, int force)
+{
+    if (w->journalFd < 0 || w->hashed == w->journalled ||
+        (!force && w->hashed - w->journalled < JOURNAL_INTERVAL))
+        return;
+
+    if (w->map != NULL)
+        msync(w->map, w->mapSize, MS_SYNC);
+    else
+        fdatasync(w->fd);
+
+    // In-order delivery makes the hashed bytes exactly the written prefix
+    Checkpoint cp = {w->fileSize, w->sourceMtime, w->hashed, w->hash};
+    if (journalSave(w->journalFd, &cp) == -1)
+        perror(w->journalPath);
+    w->journalled = w->hashed;
+}
+
+// Close the current output file, syncing it as the fsync policy asks
+void finishFile(FileWriter *w)
+{
+    if (w->fd < 0)
+        return;
+
+    drainChunks(w);
+    if (w->map != NULL)
+    {
+        if (w->fsyncPolicy != FsyncNone)
+            msync(w->map, w->mapSize, MS_SYNC);
+        munmap(w->map, w->mapSize);
+        w->map = NULL;
+    }
+    else if (w->fsyncPolicy != FsyncNone && w->seekable)
+    {
+        fsync(w->fd);
+    }
+    // For standard output this is the last write end, the reader sees EOF
+    close(w->fd);
+    w->fd = -1;
+
+    if (w->fileSize != UNKNOWN_SIZE && w->received != w->fileSize)
+    {
+        printf("Size mismatch: expected %llu bytes, got %llu\n",
+               (unsigned long long)w->fileSize, (unsigned long long)w->received);
+        w->failed = TRUE;
+    }
+    w->totalReceived += w->received;
+    w->files++;
+
+    // The file is complete, nothing left to resume
+    if (w->journalFd >= 0)
+    {
+        close(w->journalFd);
+        w->journalFd = -1;
+        unlink(w->journalPath);
+    }
+
+    // A delta replaces the old copy only once the new one checked out
+    if (w->baseFd >= 0)
+    {
+        close(w->baseFd);
+        w->baseFd = -1;
+    }
+    if (w->deltaPath[0] != '\0')
+    {
+        if (w->failed)
+        {
+            printf("Delta failed, keeping the old copy\n");
+            unlink(w->deltaPath);
+        }
+        else if (rename(w->deltaPath, w->outputPath) == -1)
+        {
+            perror("rename");
+            w->failed = TRUE;
+        }
+        w->deltaPath[0] = '\0';
+    }
+}
+
+// Copy a range of the old copy named by a REF packet into the new file
+void copyReference(FileWriter *w, const unsigned char *buf, int size)
+{
+    static unsigned char block[CHUNK_SIZE];
+
+    if (w->fd < 0 || size < REF_PACKET_SIZE)
+        return;
+    if (w->baseFd < 0)
+    {
+        printf("Reference without an old copy\n");
+        w->failed = TRUE;
+        return;
+    }
+
+    uint64_t dest = getU64(buf + 1), source = getU64(buf + 9);
+    uint32_t length = getU32(buf + 17);
+
+    while (length > 0)
+    {
+        size_t n = length < CHUNK_SIZE ? length : CHUNK_SIZE;
+        if (pread(w->baseFd, block, n, source) != (ssize_t)n)
+        {
+            printf("Reference past the end of the old copy\n");
+            w->failed = TRUE;
+            return;
+        }
+        writePayload(w, dest, block, n);
+        dest += n;
+        source += n;
+        length -= n;
+    }
+}
+
+// Reassemble chunk records from ZDATA packets and hand complete ones to
+// the decompression pool. Chunks come back, and are written, in order.
+void receiveZData(FileWriter *w, const unsigned char *buf, int size)
+{
+    if (w->fd < 0 || size < DATA_HEADER_SIZE)
+        return;
+    uint64_t offset = getU64(buf + 1);
+    int length = buf[9] * 256 + buf[10];
+    const unsigned char *data = buf + DATA_HEADER_SIZE;
+    if (length > size - DATA_HEADER_SIZE || offset + length <= w->zReceived)
+        return;
+    if (offset > w->zReceived)
+    {
+        printf("Compressed stream gap at byte %llu\n", (unsigned long long)offset);
+        w->failed = TRUE;
+        return;
+    }
+    data += w->zReceived - offset;
+    length -= w->zReceived - offset;
+    w->zReceived += length;
+
+    if (startChunkPool(decompressChunk) == -1)
+    {
+        w->failed = TRUE;
+        return;
+    }
+
+    while (length > 0)
+    {
+        if (w->zChunk == NULL)
+        {
+            // Every chunk is in flight, write the oldest to free one
+            while ((w->zChunk = chunkPoolAcquire(&chunkPool)) == NULL)
+                collectChunk(w);
+            w->zFill = 0;
+        }
+
+        Chunk *chunk = w->zChunk;
+        int recordSize = CHUNK_HEADER_SIZE;
+        if (w->zFill >= CHUNK_HEADER_SIZE)
+            recordSize += getU32(chunk->in + 12);
+
+        int n = recordSize - w->zFill < length ? recordSize - w->zFill : length;
+        memcpy(chunk->in + w->zFill, data, n);
+        w->zFill += n;
+        data += n;
+        length -= n;
+
+        if (w->zFill == CHUNK_HEADER_SIZE)
+        {
+            uint32_t rawSize = getU32(chunk->in + 8), storedSize = getU32(chunk->in + 12);
+            if (rawSize == 0 || rawSize > CHUNK_SIZE || storedSize == 0 || storedSize > rawSize)
+            {
+                printf("Invalid compressed chunk header\n");
+                w->failed = TRUE;
+                w->zFill = 0;
+                return;
+            }
+        }
+        else if (w->zFill == recordSize)
+        {
+            chunkPoolSubmit(&chunkPool);
+            w->zChunk = NULL;
+        }
+    }
+
+    // A stream's reader may be waiting for these bytes
+    if (!w->seekable)
+        drainChunks(w);
+}
+
+// Open the output file announced by a START packet
+void openOutputFile(FileWriter *w, const unsigned char *buf, int size)
+{
+    char name[256], path[PATH_MAX];
+
+    finishFile(w); // A previous file whose END was lost
+    w->fileSize = parseCPacket(buf, size, name, sizeof(name));
+    w->received = 0;
+    w->zReceived = 0;
+    w->zFill = 0;
+    hashInit(&w->hash, 0);
+    w->hashed = 0;
+
+    if (w->batch)
+    {
+        // Only the base name is used, so a batch cannot write outside its directory
+        const char *base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+        if (base[0] == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0)
+        {
+            printf("Skipping file with invalid name '%s'\n", name);
+            w->failed = TRUE;
+            return;
+        }
+        snprintf(path, sizeof(path), "%s/%s", w->outputPath, base);
+    }
+    else
+    {
+        snprintf(path, sizeof(path), "%s", w->outputPath);
+    }
+
+    const unsigned char *value;
+    w->sourceMtime = findTLV(buf, size, T_MTIME, &value) == 8 ? getU64(value) : 0;
+    w->journalled = 0;
+    if (!w->batch && stdoutFd >= 0)
+    {
+        w->fd = stdoutFd;
+        stdoutFd = -1;
+    }
+    else if (!w->batch && findTLV(buf, size, T_RESUME, &value) >= 0)
+    {
+        // Same decision as the link thread's RESUME reply: keep the
+        // confirmed bytes and carry on hashing from them
+        Checkpoint cp;
+        journalPath(w->journalPath, sizeof(w->journalPath), path);
+        if (journalLoad(w->journalPath, w->fileSize, w->sourceMtime, &cp) == 0)
+        {
+            w->fd = open(path, O_RDWR | O_CREAT, 0666);
+            w->hash = cp.hash;
+            w->hashed = w->received = w->journalled = cp.confirmed;
+            printf("Resuming at byte %llu\n", (unsigned long long)cp.confirmed);
+        }
+        else
+        {
+            w->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        }
+        w->journalFd = open(w->journalPath, O_RDWR | O_CREAT, 0666);
+    }
+    else if (!w->batch && findTLV(buf, size, T_DELTA, &value) >= 0)
+    {
+        // Build the new copy beside the old one, REF packets read from it
+        w->baseFd = open(path, O_RDONLY);
+        snprintf(w->deltaPath, sizeof(w->deltaPath), "%s.delta", path);
+        w->fd = open(w->deltaPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    }
+    else
+    {
+        w->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    }
+    if (w->fd < 0)
+    {
+        perror(path);
+        w->failed = TRUE;
+        return;
+    }
+
+    struct stat st;
+    w->seekable = fstat(w->fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    // An empty file or a stream has nothing to map, and a failed mapping
+    // falls back to pwrite
+    if (useMmap && w->seekable && w->fileSize != UNKNOWN_SIZE && w->fileSize > 0)
+        mapOutputFile(w, w->fileSize);
+}
+
+// Handle one application packet on the writer thread
+void handlePacket(FileWriter *w, const unsigned char *buf, int size)
+{
+    switch (buf[0])
+    {
+    case MANIFEST_PACKET:
+    {
+        char unused[1];
+        uint64_t total = parseCPacket(buf, size, unused, sizeof(unused));
+        uint64_t count = size >= 11 && buf[1] == T_COUNT ? getU64(buf + 3) : 0;
+        printf("Receiving %llu files, %llu bytes\n", (unsigned long long)count, (unsigned long long)total);
+
+        w->batch = TRUE;
+        if (mkdir(w->outputPath, 0777) == -1 && errno != EEXIST)
+        {
+            perror(w->outputPath);
+            w->failed = TRUE;
+        }
+        break;
+    }
+
+    case START_PACKET:
+        openOutputFile(w, buf, size);
+        break;
+
+    case DATA_PACKET:
+    {
+        if (w->fd < 0 || size < DATA_HEADER_SIZE)
+            break;
+        uint64_t offset = getU64(buf + 1);
+        unsigned int addSize = buf[9] * 256 + buf[10];
+        if (addSize > size - DATA_HEADER_SIZE)
+            break;
+
+        writePayload(w, offset, buf + DATA_HEADER_SIZE, addSize);
+        break;
+    }
+
+    case ZDATA_PACKET:
+        receiveZData(w, buf, size);
+        break;
+
+    case REF_PACKET:
+        copyReference(w, buf, size);
+        break;
+
+    case END_PACKET:
+    {
+        // A stream's size is only known now
+        char name[256];
+        uint64_t finalSize = parseCPacket(buf, size, name, sizeof(name));
+        if (w->fileSize == UNKNOWN_SIZE)
+            w->fileSize = finalSize;
+
+        // Compare with the transmitter's hash before closing the file
+        const unsigned char *value;
+        drainChunks(w);
+        if (w->fd >= 0 && findTLV(buf, size, T_HASH, &value) == 8)
+        {
+            uint64_t expected = getU64(value), actual = hashDigest(&w->hash);
+            if (expected != actual)
+            {
+                printf("Hash mismatch: expected %016llx, got %016llx\n",
+                       (unsigned long long)expected, (unsigned long long)actual);
+                w->failed = TRUE;
+                w->hashMismatches++;
+            }
+            else if (!w->batch)
+            {
+                printf("Hash OK: %016llx\n", (unsigned long long)actual);
+            }
+            w->hashChecked++;
+        }
+        finishFile(w);
+        break;
+    }
+
+    case BUNDLE_PACKET:
+        for (int i = 1; i + 2 <= size;)
+        {
+            int length = buf[i] << 8 | buf[i + 1];
+            i += 2;
+            if (length == 0 || length > size - i)
+                break;
+            if (buf[i] != BUNDLE_PACKET)
+                handlePacket(w, buf + i, length);
+            i += length;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Writer thread: applies queued packets to the output files
+void *writerThread(void *arg)
+{
+    FileWriter *w = arg;
+    size_t skip = 0; // Bytes of the oldest DATA frame already written
+
+    while (packetQueueWait(&rxQueue, 1) > 0)
+    {
+        int size;
+        unsigned char *buf = packetQueuePeek(&rxQueue, 0, &size);
+
+        // Runs of plain DATA frames are coalesced into large writes
+        if (buf[0] == DATA_PACKET && w->fd >= 0 && w->map == NULL)
+        {
+            packetQueuePop(&rxQueue, writeCoalesced(w, &skip));
+            checkpoint(w, FALSE);
+            continue;
+        }
 
-        if (llwrite(buf, bytesRead + 4) == -1) 
+        handlePacket(w, buf, size);
+        packetQueuePop(&rxQueue, 1);
+        checkpoint(w, FALSE);
+    }
+
+    finishFile(w);
+    return NULL;
+}
+
+// Send the block signature of the existing copy at "path" (NULL or a
+// missing file sends an empty one, so everything goes as literals)
+int sendSignature(const char *path)
+{
+    unsigned char buf[MAX_PAYLOAD_SIZE];
+    int file = path != NULL ? open(path, O_RDONLY) : -1;
+    struct stat st;
+    uint64_t size = 0;
+    if (file >= 0 && fstat(file, &st) == 0 && S_ISREG(st.st_mode))
+        size = st.st_size;
+
+    size_t blockSize = deltaBlockSize(size);
+    uint32_t count = size / blockSize; // A short last block is always sent as literals
+    uint32_t index = 0;
+    unsigned char *block = malloc(blockSize);
+    if (block == NULL)
+        count = 0;
+
+    buf[0] = SIGNATURE_PACKET;
+    putU32(buf + 1, blockSize);
+    putU32(buf + 5, count);
+    do
+    {
+        int n = SIGNATURE_HEADER_SIZE;
+        putU32(buf + 9, index);
+        while (index < count && n + SIGNATURE_ENTRY_SIZE <= MAX_PAYLOAD_SIZE)
+        {
+            // A block that cannot be read only costs its match
+            BlockSignature sig = {0, 0};
+            if (pread(file, block, blockSize, (uint64_t)index * blockSize) == (ssize_t)blockSize)
+                blockSignature(block, blockSize, &sig);
+            putU32(buf + n, sig.weak);
+            putU64(buf + n + 4, sig.strong);
+            n += SIGNATURE_ENTRY_SIZE;
+            index++;
+        }
+
+        if (llwrite(buf, n) == -1)
         {
             printf("Maximum tries reached\n");
             exit(-1);
         }
-        packetNumber++;
-    }
+    } while (index < count);
 
-    fclose(f);
+    printf("Sent signature: %u blocks of %zu bytes\n", count, blockSize);
+    free(block);
+    if (file >= 0)
+        close(file);
     return 0;
 }
 
-// Function to direct packet send request to appropriate function based on packet type
-int sendPacket(int fd, unsigned char packetType, const char *filename) 
+// Where received channel messages go, set with APP_CONTROL_OUT (stderr if unset)
+int channelOutFd = -1;
+LatencyStats channelLatency[MAX_CHANNELS];
+
+// Write a received channel message out and record its one-way latency
+void deliverChannelMessage(const unsigned char *buf, int size)
 {
-    switch (packetType) {
-        case START_PACKET:
-        
-        case END_PACKET:
-            return sendCPacket(fd, packetType, filename);
-        
-        case DATA_PACKET:
-            return sendDPacket(fd, filename);
+    if (size < CHANNEL_HEADER_SIZE || buf[1] >= MAX_CHANNELS)
+        return;
 
-        default:
-            return -1;
+    // Only meaningful when both clocks are synchronized, e.g. on one host
+    uint64_t sent = getU64(buf + 2), now = realtimeNs();
+    latencyAdd(&channelLatency[buf[1]], now > sent ? now - sent : 0);
+
+    if (channelOutFd < 0)
+    {
+        const char *path = getenv("APP_CONTROL_OUT");
+        channelOutFd = path != NULL ? open(path, O_WRONLY | O_CREAT | O_APPEND, 0666) : -1;
+        if (channelOutFd < 0)
+            channelOutFd = STDERR_FILENO;
+    }
+    if (write(channelOutFd, buf + CHANNEL_HEADER_SIZE, size - CHANNEL_HEADER_SIZE) == -1)
+        perror("channel output");
+}
+
+// Tell the transmitter where to resume, from the journal next to "path"
+// (NULL for outputs that cannot resume)
+int sendResumeOffset(const char *path, const unsigned char *start, int size)
+{
+    char name[256], journal[PATH_MAX + 8];
+    const unsigned char *value;
+    uint64_t fileSize = parseCPacket(start, size, name, sizeof(name));
+    uint64_t mtime = findTLV(start, size, T_MTIME, &value) == 8 ? getU64(value) : 0;
+    Checkpoint cp = {0};
+
+    if (path != NULL)
+    {
+        journalPath(journal, sizeof(journal), path);
+        if (journalLoad(journal, fileSize, mtime, &cp) == -1)
+            cp.confirmed = 0;
+    }
+
+    unsigned char buf[RESUME_PACKET_SIZE];
+    buf[0] = RESUME_PACKET;
+    putU64(buf + 1, cp.confirmed);
+    if (llwrite(buf, RESUME_PACKET_SIZE) == -1)
+    {
+        printf("Maximum tries reached\n");
+        exit(-1);
     }
+    return 0;
 }
 
-// Function to receive packets and write data to file as per packet type
+// Function to receive packets and hand them to the writer thread
 int receivePacket(int fd, const char *filename) 
 {   
-    FILE *f;
-    unsigned int addSize, bytesRead;
-    unsigned char buf[(MAX_PAYLOAD_SIZE+4)*2];
-    int packetNumber = 0;
+    int bytesRead;
+    int batch = FALSE;
+    pthread_t writerId;
+
+    packetQueueInit(&rxQueue);
+    memset(&writer, 0, sizeof(writer));
+    writer.outputPath = filename;
+    writer.fd = -1;
+    writer.baseFd = -1;
+    writer.journalFd = -1;
+    parseFsyncPolicy(&writer);
+
+    if (pthread_create(&writerId, NULL, writerThread, &writer) != 0)
+    {
+        perror("pthread_create");
+        return -1;
+    }
    
     while (1) {
+        // llread straight into a queue slot, so packets need no extra copy
+        unsigned char *buf = packetQueueReserve(&rxQueue);
         bytesRead = llread(buf);
+        if (bytesRead <= 0)
+            continue;
+
+        // Drop DATA packets whose length field does not match the frame
+        if ((buf[0] == DATA_PACKET || buf[0] == ZDATA_PACKET) &&
+            (bytesRead < DATA_HEADER_SIZE || buf[9] * 256 + buf[10] > bytesRead - DATA_HEADER_SIZE))
+            continue;
 
-        if (buf[0] == START_PACKET) 
+        unsigned char type = buf[0];
+        const unsigned char *value;
+
+        // Channel messages are delivered right here, never behind file writes
+        if (type == CHANNEL_PACKET)
         {
-            f = fopen(filename, "wb");
-        } else if (bytesRead > 0 && buf[0] == DATA_PACKET) 
+            deliverChannelMessage(buf, bytesRead);
+            continue;
+        }
+
+        int deltaRequested = type == START_PACKET && findTLV(buf, bytesRead, T_DELTA, &value) >= 0;
+        int resumeRequested = type == START_PACKET && findTLV(buf, bytesRead, T_RESUME, &value) >= 0;
+
+        // The next llread, and so its RR, never waits on disk
+        packetQueuePush(&rxQueue, bytesRead);
+
+        // The transmitter waits for our signature before sending the delta
+        if (deltaRequested)
+            sendSignature(batch || strcmp(filename, "-") == 0 ? NULL : filename);
+        else if (resumeRequested)
+            sendResumeOffset(batch || strcmp(filename, "-") == 0 ? NULL : filename, buf, bytesRead);
+
+        if (type == MANIFEST_PACKET)
         {
-            addSize = buf[2] * 256 + buf[3];
-            fwrite(buf + 4, 1, addSize, f);
-            if (buf[1] == packetNumber) 
-            {
-                packetNumber++;
-            }
-        } else if (buf[0] == END_PACKET)
+            batch = TRUE;
+        }
+        else if ((type == END_PACKET && !batch) || type == BATCH_END_PACKET)
         {
             printf("ENDING\n");
             break;
         }
     }
+
+    packetQueueClose(&rxQueue);
+    pthread_join(writerId, NULL);
+
+    packetQueueStats(&rxQueue, "Receive");
+    printf("Writer: %llu bytes in %llu writes, %llu files\n",
+           writer.bytesWritten, writer.writes, writer.files);
+    if (writer.batch)
+        printf("Hash: %llu files checked, %llu mismatches\n",
+               writer.hashChecked, writer.hashMismatches);
+
+    for (int i = 1; i < MAX_CHANNELS; i++)
+    {
+        char label[64];
+        snprintf(label, sizeof(label), "Channel %d one-way latency", i);
+        if (channelLatency[i].count > 0)
+            latencyPrint(&channelLatency[i], label);
+    }
+    transferBytes = writer.totalReceived;
     
-    fclose(f);
-    return fd;
+    return writer.failed ? -1 : fd;
 }
 
 void applicationLayer(const char *port, const char *role, int baudRate,
@@ -138,6 +2110,19 @@ void applicationLayer(const char *port, const char *role, int baudRate,
     strcpy(linkLayer.serialPort, port);
     linkLayer.timeout = timeout;
     
+    useMmap = envFlag("APP_MMAP");
+    useCompress = envFlag("APP_COMPRESS");
+    useDelta = envFlag("APP_DELTA");
+    useResume = envFlag("APP_RESUME");
+
+    const char *frameSize = getenv("APP_FRAME_SIZE");
+    if (frameSize != NULL && atoi(frameSize) > DATA_HEADER_SIZE && atoi(frameSize) < MAX_PAYLOAD_SIZE)
+        dataChunkSize = atoi(frameSize) - DATA_HEADER_SIZE;
+
+    // "-" streams the file through standard input or output
+    if (linkRole == LlRx && strcmp(filename, "-") == 0)
+        detachStdout();
+
     int fd = llopen(linkLayer);
     
     if (fd == -1)
@@ -148,15 +2133,41 @@ void applicationLayer(const char *port, const char *role, int baudRate,
     switch (applicationLayer.status)
     {   
         case 1:
-            printf("Sending file\n");
-            sendPacket(fd, START_PACKET, filename);
-            sendPacket(fd, DATA_PACKET, filename);
-            sendPacket(fd, END_PACKET, filename);
+        {
+            startChannels();
+
+            // A directory is sent as a batch of files in one session
+            struct stat st;
+            int result;
+            if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode))
+            {
+                printf("Sending directory\n");
+                result = sendBatch(fd, filename);
+            }
+            else
+            {
+                printf("Sending file\n");
+                result = sendFile(fd, filename, filename);
+            }
+            if (result == -1)
+            {
+                printf("Transfer failed\n");
+                exit(-1);
+            }
+            if (!useMmap || useCompress)
+                packetQueueStats(&txQueue, "Transmit");
+            if (scheduler.count > 1)
+                schedulerStats(&scheduler);
+            printCompressionStats();
+            printCpuUsage();
             break;
+        }
         
         case 0:
-            printf("Receiving file\n");
+            printf("Receiving %s\n", stdoutFd >= 0 ? "to standard output" : "file");
             receivePacket(fd, filename);
+            printCompressionStats();
+            printCpuUsage();
             break;
         
         default:
@@ -164,6 +2175,9 @@ void applicationLayer(const char *port, const char *role, int baudRate,
         
     }
 
+    if (chunkPoolStarted)
+        chunkPoolDestroy(&chunkPool);
+
     printf("END\n");
     llclose(0);
 }
@@ -0,0 +1,138 @@
+// Logical channel scheduler implementation
+
+#include "channel.h"
+#include <stdio.h>
+
+void channelInit(Channel *channel, int id, const char *name, PacketQueue *queue, int priority, int weight)
+{
+    channel->id = id;
+    channel->name = name;
+    channel->queue = queue;
+    channel->priority = priority;
+    channel->weight = weight;
+    channel->credits = weight;
+    channel->frames = 0;
+    channel->bytes = 0;
+    channel->latency = (LatencyStats){0};
+}
+
+void schedulerAdd(Scheduler *scheduler, Channel *channel)
+{
+    if (scheduler->count < MAX_CHANNELS)
+        scheduler->channels[scheduler->count++] = channel;
+}
+
+// Pick the most urgent ready channel that still has credits. When every
+// ready channel used up its share, a new round starts.
+static Channel *pickReady(Scheduler *scheduler)
+{
+    for (int round = 0; round < 2; round++)
+    {
+        Channel *best = NULL;
+        int anyReady = 0;
+
+        for (int i = 0; i < scheduler->count; i++)
+        {
+            Channel *channel = scheduler->channels[i];
+            int size;
+            if (packetQueuePeek(channel->queue, 0, &size) == NULL)
+                continue;
+            anyReady = 1;
+            if (channel->credits > 0 && (best == NULL || channel->priority < best->priority))
+                best = channel;
+        }
+
+        if (best != NULL)
+        {
+            best->credits--;
+            return best;
+        }
+        if (!anyReady)
+            return NULL;
+
+        for (int i = 0; i < scheduler->count; i++)
+            scheduler->channels[i]->credits = scheduler->channels[i]->weight;
+    }
+    return NULL;
+}
+
+Channel *schedulerNext(Scheduler *scheduler, Channel *primary)
+{
+    int spins = 0;
+
+    // A lone channel simply waits on its queue
+    if (scheduler->count == 1)
+        return packetQueueWait(primary->queue, 1) > 0 ? primary : NULL;
+
+    while (1)
+    {
+        unsigned int ticket = packetQueueTicket();
+        Channel *channel = pickReady(scheduler);
+        if (channel != NULL)
+            return channel;
+
+        // Checked after the queues, the producer may push right before closing
+        if (packetQueueClosed(primary->queue) && packetQueueWait(primary->queue, 1) == 0)
+            return NULL;
+        packetQueueBackoff(&spins, ticket);
+    }
+}
+
+void channelSent(Channel *channel, int size)
+{
+    channel->frames++;
+    channel->bytes += size;
+    latencyAdd(&channel->latency, monotonicNs() - packetQueueStamp(channel->queue));
+}
+
+void latencyAdd(LatencyStats *stats, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (1ULL << bucket) <= us)
+        bucket++;
+
+    stats->count++;
+    stats->totalNs += ns;
+    if (ns > stats->maxNs)
+        stats->maxNs = ns;
+    stats->buckets[bucket]++;
+}
+
+// Upper bound, in ms, of the bucket holding the given fraction of samples,
+// capped by the largest sample
+static double latencyPercentile(const LatencyStats *stats, double fraction)
+{
+    unsigned long long seen = 0, target = stats->count * fraction;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += stats->buckets[i];
+        if (seen > target)
+            return (1ULL << i) / 1000.0 < stats->maxNs / 1e6 ? (1ULL << i) / 1000.0 : stats->maxNs / 1e6;
+    }
+    return stats->maxNs / 1e6;
+}
+
+void latencyPrint(const LatencyStats *stats, const char *label)
+{
+    if (stats->count == 0)
+    {
+        printf("%s: no samples\n", label);
+        return;
+    }
+
+    printf("%s: %llu samples, avg %.2f ms, p50 <%.2f ms, p99 <%.2f ms, max %.2f ms\n",
+           label, stats->count, stats->totalNs / 1e6 / stats->count,
+           latencyPercentile(stats, 0.5), latencyPercentile(stats, 0.99), stats->maxNs / 1e6);
+}
+
+void schedulerStats(const Scheduler *scheduler)
+{
+    for (int i = 0; i < scheduler->count; i++)
+    {
+        const Channel *channel = scheduler->channels[i];
+        printf("Channel %d (%s): %llu frames, %llu bytes\n",
+               channel->id, channel->name, channel->frames, channel->bytes);
+        latencyPrint(&channel->latency, "  queue to RR latency");
+    }
+}
@@ -0,0 +1,125 @@
+// Ordered chunk worker pool implementation
+
+#include "chunk_pool.h"
+#include <stdio.h>
+#include <unistd.h>
+
+// Worker thread: takes submitted chunks in order and applies the work function
+static void *chunkWorker(void *arg)
+{
+    ChunkPool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (pool->claimed == pool->queued && !pool->stop)
+            pthread_cond_wait(&pool->submitted, &pool->lock);
+        if (pool->claimed == pool->queued)
+            break;
+
+        Chunk *chunk = &pool->chunks[pool->claimed % CHUNK_POOL_SLOTS];
+        pool->claimed++;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->work(chunk);
+
+        pthread_mutex_lock(&pool->lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int chunkPoolInit(ChunkPool *pool, ChunkWork work, int workers)
+{
+    if (workers < 1)
+        workers = 1;
+    if (workers > CHUNK_POOL_MAX_WORKERS)
+        workers = CHUNK_POOL_MAX_WORKERS;
+
+    pool->work = work;
+    pool->released = 0;
+    pool->claimed = 0;
+    pool->queued = 0;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->submitted, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    for (pool->workerCount = 0; pool->workerCount < workers; pool->workerCount++)
+    {
+        if (pthread_create(&pool->workers[pool->workerCount], NULL, chunkWorker, pool) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+    }
+    return pool->workerCount > 0 ? 0 : -1;
+}
+
+Chunk *chunkPoolAcquire(ChunkPool *pool)
+{
+    // Only the owner moves "queued" and "released", no lock needed to read them
+    if (pool->queued - pool->released == CHUNK_POOL_SLOTS)
+        return NULL;
+
+    Chunk *chunk = &pool->chunks[pool->queued % CHUNK_POOL_SLOTS];
+    chunk->done = 0;
+    return chunk;
+}
+
+void chunkPoolSubmit(ChunkPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->submitted);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+Chunk *chunkPoolCollect(ChunkPool *pool)
+{
+    if (pool->queued == pool->released)
+        return NULL;
+
+    Chunk *chunk = &pool->chunks[pool->released % CHUNK_POOL_SLOTS];
+
+    pthread_mutex_lock(&pool->lock);
+    while (!chunk->done)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return chunk;
+}
+
+void chunkPoolRelease(ChunkPool *pool)
+{
+    pool->released++;
+}
+
+int chunkPoolPending(ChunkPool *pool)
+{
+    return pool->queued - pool->released;
+}
+
+void chunkPoolDestroy(ChunkPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->submitted);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->workerCount; i++)
+        pthread_join(pool->workers[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->submitted);
+    pthread_cond_destroy(&pool->finished);
+}
+
+int chunkPoolDefaultWorkers(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    return cpus > CHUNK_POOL_MAX_WORKERS ? CHUNK_POOL_MAX_WORKERS : cpus;
+}
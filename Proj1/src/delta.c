@@ -0,0 +1,127 @@
+// Delta transfer signatures and rolling checksum implementation
+
+#include "delta.h"
+#include <stdlib.h>
+#include "hash.h"
+
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
+
+// Offset added to every byte so runs of zeros still move the checksum
+#define CHAR_OFFSET 31
+
+size_t deltaBlockSize(uint64_t fileSize)
+{
+    // About sqrt(size) blocks of sqrt(size) bytes, as rsync does
+    size_t blockSize = MIN_BLOCK_SIZE;
+    while (blockSize < MAX_BLOCK_SIZE && (uint64_t)blockSize * blockSize < fileSize)
+        blockSize *= 2;
+    return blockSize;
+}
+
+void rollingInit(RollingSum *sum, const unsigned char *data, size_t length)
+{
+    sum->a = 0;
+    sum->b = 0;
+    sum->length = length;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        sum->a += data[i] + CHAR_OFFSET;
+        sum->b += (length - i) * (data[i] + CHAR_OFFSET);
+    }
+}
+
+void rollingRotate(RollingSum *sum, unsigned char out, unsigned char in)
+{
+    sum->a += in - out;
+    sum->b += sum->a - sum->length * (out + CHAR_OFFSET);
+}
+
+uint32_t rollingDigest(const RollingSum *sum)
+{
+    return (sum->a & 0xFFFF) | (sum->b << 16);
+}
+
+void blockSignature(const unsigned char *data, size_t length, BlockSignature *sig)
+{
+    RollingSum sum;
+    rollingInit(&sum, data, length);
+    sig->weak = rollingDigest(&sum);
+
+    HashState state;
+    hashInit(&state, 0);
+    hashUpdate(&state, data, length);
+    sig->strong = hashDigest(&state);
+}
+
+// Bucket of a rolling checksum, mixing both halves
+static unsigned int bucket(const SignatureIndex *index, uint32_t weak)
+{
+    return (weak * 2654435761U) >> 7 & index->mask;
+}
+
+int signatureIndexBuild(SignatureIndex *index, const BlockSignature *blocks, int count, size_t blockSize)
+{
+    unsigned int size = 1;
+    while (size < 2 * (unsigned int)count)
+        size *= 2;
+
+    index->blocks = blocks;
+    index->count = count;
+    index->blockSize = blockSize;
+    index->mask = size - 1;
+    index->heads = malloc(size * sizeof(int));
+    index->next = malloc((count > 0 ? count : 1) * sizeof(int));
+    if (index->heads == NULL || index->next == NULL)
+    {
+        signatureIndexFree(index);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < size; i++)
+        index->heads[i] = -1;
+
+    // Insert from the end so each bucket lists blocks in file order
+    for (int i = count - 1; i >= 0; i--)
+    {
+        unsigned int b = bucket(index, blocks[i].weak);
+        index->next[i] = index->heads[b];
+        index->heads[b] = i;
+    }
+    return 0;
+}
+
+int signatureIndexFind(const SignatureIndex *index, uint32_t weak, const unsigned char *data, int prefer)
+{
+    int first = index->heads[bucket(index, weak)];
+    while (first >= 0 && index->blocks[first].weak != weak)
+        first = index->next[first];
+    if (first < 0)
+        return -1;
+
+    // The strong hash is only computed once a rolling checksum matches
+    HashState state;
+    hashInit(&state, 0);
+    hashUpdate(&state, data, index->blockSize);
+    uint64_t strong = hashDigest(&state);
+
+    if (prefer >= 0 && prefer < index->count &&
+        index->blocks[prefer].weak == weak && index->blocks[prefer].strong == strong)
+        return prefer;
+
+    for (int block = first; block >= 0; block = index->next[block])
+    {
+        if (index->blocks[block].weak == weak && index->blocks[block].strong == strong)
+            return block;
+    }
+    return -1;
+}
+
+void signatureIndexFree(SignatureIndex *index)
+{
+    free(index->heads);
+    free(index->next);
+    index->heads = NULL;
+    index->next = NULL;
+}
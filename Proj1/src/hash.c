@@ -0,0 +1,130 @@
+// XXH64 streaming hash implementation
+
+#include "hash.h"
+#include <string.h>
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+// Little-endian loads, independent of the host byte order
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = ROTL(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t mergeRound(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+void hashInit(HashState *state, uint64_t seed)
+{
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->v[0] = seed + PRIME1 + PRIME2;
+    state->v[1] = seed + PRIME2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME1;
+}
+
+void hashUpdate(HashState *state, const unsigned char *data, size_t size)
+{
+    const unsigned char *end = data + size;
+    state->totalLen += size;
+
+    // Not enough for a full stripe yet, keep the bytes for later
+    if (state->memSize + size < 32)
+    {
+        memcpy(state->mem + state->memSize, data, size);
+        state->memSize += size;
+        return;
+    }
+
+    // Complete the pending stripe first
+    if (state->memSize > 0)
+    {
+        memcpy(state->mem + state->memSize, data, 32 - state->memSize);
+        for (int i = 0; i < 4; i++)
+            state->v[i] = round64(state->v[i], read64(state->mem + 8 * i));
+        data += 32 - state->memSize;
+        state->memSize = 0;
+    }
+
+    while (data + 32 <= end)
+    {
+        for (int i = 0; i < 4; i++)
+            state->v[i] = round64(state->v[i], read64(data + 8 * i));
+        data += 32;
+    }
+
+    state->memSize = end - data;
+    memcpy(state->mem, data, state->memSize);
+}
+
+uint64_t hashDigest(const HashState *state)
+{
+    uint64_t h;
+
+    if (state->totalLen >= 32)
+    {
+        h = ROTL(state->v[0], 1) + ROTL(state->v[1], 7) + ROTL(state->v[2], 12) + ROTL(state->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = mergeRound(h, state->v[i]);
+    }
+    else
+    {
+        h = state->seed + PRIME5;
+    }
+
+    h += state->totalLen;
+
+    const unsigned char *p = state->mem;
+    const unsigned char *end = p + state->memSize;
+
+    while (p + 8 <= end)
+    {
+        h ^= round64(0, read64(p));
+        h = ROTL(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = ROTL(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    while (p < end)
+    {
+        h ^= (*p) * PRIME5;
+        h = ROTL(h, 11) * PRIME1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
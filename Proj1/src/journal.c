@@ -0,0 +1,67 @@
+// Checkpoint journal implementation
+
+#include "journal.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "RCJ1"
+
+// On-disk record, overwritten in place. The check covers everything before
+// it, so a torn write is detected and ignored.
+typedef struct
+{
+    char magic[4];
+    uint32_t reserved;
+    Checkpoint checkpoint;
+    uint64_t check;
+} JournalRecord;
+
+// Hash of a record's contents
+static uint64_t recordCheck(const JournalRecord *record)
+{
+    HashState state;
+    hashInit(&state, 0);
+    hashUpdate(&state, (const unsigned char *)record, offsetof(JournalRecord, check));
+    return hashDigest(&state);
+}
+
+void journalPath(char *path, size_t size, const char *output)
+{
+    snprintf(path, size, "%s.journal", output);
+}
+
+int journalLoad(const char *path, uint64_t fileSize, uint64_t mtime, Checkpoint *checkpoint)
+{
+    JournalRecord record;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    ssize_t size = pread(fd, &record, sizeof(record), 0);
+    close(fd);
+
+    if (size != sizeof(record) || memcmp(record.magic, JOURNAL_MAGIC, 4) != 0 ||
+        record.check != recordCheck(&record))
+        return -1;
+    if (record.checkpoint.fileSize != fileSize || record.checkpoint.mtime != mtime ||
+        record.checkpoint.confirmed > fileSize)
+        return -1;
+
+    *checkpoint = record.checkpoint;
+    return 0;
+}
+
+int journalSave(int fd, const Checkpoint *checkpoint)
+{
+    JournalRecord record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.magic, JOURNAL_MAGIC, 4);
+    record.checkpoint = *checkpoint;
+    record.check = recordCheck(&record);
+
+    if (pwrite(fd, &record, sizeof(record), 0) != sizeof(record))
+        return -1;
+    return fdatasync(fd);
+}
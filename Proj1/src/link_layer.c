@@ -6,9 +6,14 @@
 #include <signal.h>
 #include <termios.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include "link_layer.h"
+#include "link_layer_ext.h"
+#include "lz.h"
 
 // Finite state machine states
 typedef enum
@@ -32,10 +37,21 @@ typedef enum
 #define FLAG 0x7e
 #define C 0x03
 #define REPEATED_MSG_CODE 2
+#define REPEATED_SET_CODE 3
+#define C_UA 0x07
+#define C_DISC 0x0B
+#define C_COALESCED 0x20 // I-frame control bit: the payload holds length-prefixed packets
+#define C_COMPRESSED 0x08 // I-frame control bit: the payload is LZ4-compressed
+#define C_NEGOTIATE 0x40  // SET/UA control bit: link compression offered/accepted
+#define I_FLAGS (C_COALESCED | C_COMPRESSED)
+#define IS_I_FRAME(c) (((c) & ~(0x80 | I_FLAGS)) == 0) // Half-duplex I-frame, N(S) in bit 7
 
 stateMachine state;
 int fd;     // file descriptor
-int sequenceNum = 0;
+// Each direction numbers its own I-frames. When the link turns around, a
+// repeat of the other end's last frame is then told apart from its next one.
+int sequenceNum = 0; // N(S) of the next I-frame we send
+int expectedNum = 0; // N(S) of the next I-frame llread takes
 int hasFailed = 0;
 int alarmCount = 0;
 int alarmOn;
@@ -46,6 +62,69 @@ struct termios oldtio; // old terminal IO settings
 int nRetransmissions = 0;
 LinkLayer linkLayer;
 
+// Fast-open: the transmitter sends the first I-frame right after SET and
+// collects the UA together with the RR of that frame
+int fastOpen = FALSE;
+int uaPending = FALSE;
+
+// Full duplex: both ends send I-frames, see the FULL DUPLEX section
+int duplex = FALSE;
+
+// Control field of the last frame received
+unsigned char frameControl;
+
+// Link compression (LL_COMPRESS=1): offered in SET, accepted in UA
+int linkCompress = FALSE;
+unsigned char setControl = C;
+unsigned char uaControl = C_UA;
+
+// Coalescing: small packets share I-frames, flushed after this many ms (0 is off)
+int coalesceDelay = 0;
+static int coalesceStart(void);
+
+// Read strategy (LL_READ_PROFILE), measured with bench/read_bench:
+//   unset       VMIN=0 VTIME=1, one byte per read()
+//   throughput  VMIN=0 VTIME=1, each read() takes all that arrived
+//   latency     VMIN=0 VTIME=0 and poll() first, each read() takes all that
+//               arrived; poll() returns on SIGALRM where a read restarts
+//               and waits out VTIME
+// readByte hands the buffered bytes out one at a time.
+#define READ_BUFFER_SIZE 4096
+#define READ_TIMEOUT 100 // ms, as VTIME=1
+
+static int readPoll;
+static int readChunk = 1;
+static unsigned char readBuffer[READ_BUFFER_SIZE];
+static int readPos, readEnd;
+
+int envFlag(const char *name)
+{
+    const char *value = getenv(name);
+    return value != NULL && strcmp(value, "0") != 0;
+}
+
+// Read one byte of the port into "byte".
+// Return 1, or 0 when none arrived within READ_TIMEOUT or a signal came first.
+static int readByte(unsigned char *byte)
+{
+    if (readPos == readEnd)
+    {
+        if (readPoll)
+        {
+            struct pollfd pfd = {.fd = fd, .events = POLLIN};
+            if (poll(&pfd, 1, READ_TIMEOUT) <= 0)
+                return 0;
+        }
+        int n = read(fd, readBuffer, readChunk);
+        if (n <= 0)
+            return 0;
+        readPos = 0;
+        readEnd = n;
+    }
+    *byte = readBuffer[readPos++];
+    return 1;
+}
+
 // Manager for alarm signal
 void alarmManager(int signal)
 {
@@ -86,9 +165,13 @@ void stateDetermine(stateMachine *state, char byte, int user)
         // If FLAG is received, transition to the FLAG_RCV state
         if (byte == FLAG)
             *state = FLAG_RCV;
-        // If FLAG_C (control byte) is received, transition to the C_RCV state
-        else if (byte == FLAG_C)
+        // If FLAG_C (control byte) is received, transition to the C_RCV state.
+        // SET and UA may carry the compression bit
+        else if ((byte & ~C_NEGOTIATE) == FLAG_C)
+        {
             *state = C_RCV;
+            frameControl = byte;
+        }
         // Any other byte, revert back to the START state
         else
             *state = START;
@@ -99,7 +182,7 @@ void stateDetermine(stateMachine *state, char byte, int user)
         if (byte == FLAG)
             *state = FLAG_RCV;
         // If BCC (checksum of address and control bytes) is received, transition to the BCC_NORMAL state
-        else if (byte == BCC(FLAG_A, FLAG_C))
+        else if (byte == BCC(FLAG_A, frameControl))
             *state = BCC_NORMAL;
         // Any other byte, revert back to the START state
         else
@@ -120,6 +203,514 @@ void stateDetermine(stateMachine *state, char byte, int user)
     }
 }
 
+////////////////////////////////////////////////
+// FULL DUPLEX
+////////////////////////////////////////////////
+
+// With LL_DUPLEX=1 on both ends, either end can llwrite while the other
+// does the same. Each direction has its own sequence number, and every
+// I-frame also carries the sequence number its sender expects next (N(R)),
+// so an acknowledgment rides on outgoing data whenever there is some. A
+// reader thread owns the port: it holds I-frames for llread and hands
+// acknowledgments to llwrite.
+
+// Duplex I-frame control field: N(S) in bit 7, N(R) in bit 6
+#define C_DUPLEX 0x10
+#define I_DUPLEX(ns, nr) ((ns) << 7 | (nr) << 6 | C_DUPLEX)
+#define IS_I_DUPLEX(c) (((c) & ~(0xC0 | I_FLAGS)) == C_DUPLEX)
+
+// Largest destuffed I-frame payload accepted, BCC2 included
+#define DUPLEX_FRAME_SIZE (2 * (MAX_PAYLOAD_SIZE + 4))
+
+// Incremental parser for the frames of either kind
+typedef struct
+{
+    stateMachine state;
+    unsigned char control;
+    unsigned char BCC2; // XOR of the payload so far, BCC2 included
+    int escaped;
+    int size;
+    unsigned char data[DUPLEX_FRAME_SIZE];
+} FrameParser;
+
+static pthread_t duplexThread;
+static pthread_mutex_t duplexLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t senderLock = PTHREAD_MUTEX_INITIALIZER; // One llwrite at a time
+static pthread_mutex_t wireLock = PTHREAD_MUTEX_INITIALIZER;   // One frame on the wire at a time
+static pthread_cond_t duplexCond;
+static int wakePipe[2];
+static int stopping;
+
+static int sendSeq;     // N(S) of our next I-frame
+static int recvSeq;     // N(S) we expect from the other end
+static int awaitingAck; // Our last I-frame is not acknowledged yet
+static int rejected;    // ...and the other end asked for it again
+static unsigned char held[DUPLEX_FRAME_SIZE]; // I-frame waiting for llread
+static int heldSize = -1;
+static unsigned char heldControl;
+static int discCount, uaCount;
+
+// Delayed acknowledgments, sent on their own only if no I-frame leaves first
+static int ackDelay; // ms
+static int ackPending;
+static struct timespec ackDeadline;
+
+static unsigned long long framesSent, framesReceived, retransmissions;
+static unsigned long long rrSent, piggybackSent, piggybackReceived;
+
+// Write a whole buffer to the port
+static void writeFrame(const unsigned char *frame, int size)
+{
+    pthread_mutex_lock(&wireLock);
+    while (size > 0)
+    {
+        int n = write(fd, frame, size);
+        if (n < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            break;
+        }
+        frame += n;
+        size -= n;
+    }
+    pthread_mutex_unlock(&wireLock);
+}
+
+// Send a supervision or unnumbered frame with control field "c"
+static void sendSupervision(unsigned char c)
+{
+    unsigned char frame[] = {FLAG, A, c, BCC(A, c), FLAG};
+    writeFrame(frame, sizeof(frame));
+}
+
+// Milliseconds until "deadline", 0 if it passed
+static int msUntil(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? ms : 0;
+}
+
+static void deadlineAfter(struct timespec *deadline, long long ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += ms % 1000 * 1000000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+// Feed one byte into the parser. Return 1 when a supervision or unnumbered
+// frame ends, 2 when an I-frame with a valid BCC2 ends, -1 when an I-frame
+// fails its BCC2 and 0 otherwise.
+static int parseFrameByte(FrameParser *p, unsigned char byte)
+{
+    switch (p->state)
+    {
+    case START:
+        if (byte == FLAG)
+            p->state = FLAG_RCV;
+        break;
+
+    case FLAG_RCV:
+        if (byte == A)
+            p->state = A_RCV;
+        else if (byte != FLAG)
+            p->state = START;
+        break;
+
+    case A_RCV:
+        if (byte == FLAG)
+            p->state = FLAG_RCV;
+        else
+        {
+            p->control = byte;
+            p->state = C_RCV;
+        }
+        break;
+
+    case C_RCV:
+        if (byte == FLAG)
+            p->state = FLAG_RCV;
+        else if (byte == BCC(A, p->control))
+        {
+            p->state = IS_I_DUPLEX(p->control) ? BCC_DATA : BCC_NORMAL;
+            p->BCC2 = 0;
+            p->escaped = FALSE;
+            p->size = 0;
+        }
+        else
+            p->state = START;
+        break;
+
+    case BCC_NORMAL:
+        // The closing flag may also open the next frame
+        p->state = (byte == FLAG) ? FLAG_RCV : START;
+        return byte == FLAG;
+
+    case BCC_DATA:
+        if (byte == FLAG)
+        {
+            p->state = FLAG_RCV;
+            if (p->size < 1 || p->size > DUPLEX_FRAME_SIZE || p->BCC2 != 0)
+                return -1;
+            p->size--; // Drop BCC2
+            return 2;
+        }
+        if (byte == ESC && !p->escaped)
+        {
+            p->escaped = TRUE;
+            break;
+        }
+        if (p->escaped)
+        {
+            byte ^= 0x20;
+            p->escaped = FALSE;
+        }
+        p->BCC2 = BCC(p->BCC2, byte);
+        if (p->size < DUPLEX_FRAME_SIZE)
+            p->data[p->size] = byte;
+        p->size++;
+        break;
+
+    default:
+        break;
+    }
+    return 0;
+}
+
+// An acknowledgment for sequence number "nr" arrived. Return TRUE if it
+// acknowledges the I-frame we are waiting on. Called with duplexLock held.
+static int acknowledge(int nr)
+{
+    if (!awaitingAck || nr != 1 - sendSeq)
+        return FALSE;
+
+    sendSeq = nr;
+    awaitingAck = FALSE;
+    uaPending = FALSE; // An acknowledgment implies the SET was accepted
+    return TRUE;
+}
+
+// Act on a complete frame. Called with duplexLock held.
+static void handleFrame(const FrameParser *p, int result)
+{
+    unsigned char c = p->control;
+
+    if (result == 1)
+    {
+        if (c == ACK(0) || c == ACK(1))
+            acknowledge(c >> 7);
+        else if ((c == NACK(0) || c == NACK(1)) && awaitingAck && c >> 7 == sendSeq)
+            rejected = TRUE;
+        // A fast-open transmitter repeats SET until it sees our UA
+        else if ((c & ~C_NEGOTIATE) == C && linkLayer.role == LlRx)
+            sendSupervision(uaControl);
+        else if ((c & ~C_NEGOTIATE) == C_UA)
+        {
+            if (uaPending)
+                linkCompress = (c & C_NEGOTIATE) != 0;
+            uaPending = FALSE;
+            uaCount++;
+        }
+        else if (c == C_DISC)
+            discCount++;
+        return;
+    }
+
+    int ns = c >> 7 & 1;
+    if (result == -1)
+    {
+        // Ask again for a frame we still need, its N(R) cannot be trusted
+        if (ns == recvSeq && heldSize < 0)
+            sendSupervision(NACK(recvSeq));
+        return;
+    }
+
+    if (acknowledge(c >> 6 & 1))
+        piggybackReceived++;
+
+    // A repeated frame means our acknowledgment was lost
+    if (ns != recvSeq)
+    {
+        sendSupervision(ACK(recvSeq));
+        rrSent++;
+    }
+    // A frame already held is acknowledged once llread takes it
+    else if (heldSize < 0)
+    {
+        memcpy(held, p->data, p->size);
+        heldSize = p->size;
+        heldControl = c;
+        framesReceived++;
+    }
+}
+
+// Reader thread: parse everything the other end sends and send delayed
+// acknowledgments that found no I-frame to ride on
+static void *duplexReader(void *arg)
+{
+    FrameParser *parser = calloc(1, sizeof(FrameParser));
+    unsigned char buf[4096];
+    struct pollfd fds[2] = {{.fd = fd, .events = POLLIN}, {.fd = wakePipe[0], .events = POLLIN}};
+    parser->state = START;
+
+    // Bytes llopen read past the SET, such as a fast-open I-frame
+    pthread_mutex_lock(&duplexLock);
+    while (readPos < readEnd)
+    {
+        int result = parseFrameByte(parser, readBuffer[readPos++]);
+        if (result != 0)
+            handleFrame(parser, result);
+    }
+    pthread_mutex_unlock(&duplexLock);
+
+    while (1)
+    {
+        pthread_mutex_lock(&duplexLock);
+        if (ackPending && msUntil(&ackDeadline) == 0)
+        {
+            sendSupervision(ACK(recvSeq));
+            ackPending = FALSE;
+            rrSent++;
+        }
+        int timeout = ackPending ? msUntil(&ackDeadline) : -1;
+        int stop = stopping;
+        pthread_mutex_unlock(&duplexLock);
+
+        if (stop)
+            break;
+        if (poll(fds, 2, timeout) < 0)
+            continue;
+
+        if (fds[1].revents & POLLIN)
+            read(wakePipe[0], buf, sizeof(buf));
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            int n = read(fd, buf, sizeof(buf));
+            if (n <= 0)
+            {
+                // The other end is gone, wait for llclose without spinning
+                if (fds[0].revents & (POLLHUP | POLLERR))
+                    usleep(10000);
+                continue;
+            }
+
+            pthread_mutex_lock(&duplexLock);
+            for (int i = 0; i < n; i++)
+            {
+                int result = parseFrameByte(parser, buf[i]);
+                if (result != 0)
+                    handleFrame(parser, result);
+            }
+            pthread_cond_broadcast(&duplexCond);
+            pthread_mutex_unlock(&duplexLock);
+        }
+    }
+
+    free(parser);
+    return NULL;
+}
+
+// Wake the reader thread so it sees new state
+static void wakeReader(void)
+{
+    unsigned char byte = 0;
+    write(wakePipe[1], &byte, 1);
+}
+
+// Start the reader thread once the connection is set up
+static int duplexStart(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&duplexCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    const char *delay = getenv("LL_ACK_DELAY");
+    ackDelay = (delay != NULL) ? atoi(delay) : 0;
+    sendSeq = recvSeq = 0;
+    awaitingAck = rejected = ackPending = stopping = FALSE;
+    heldSize = -1;
+    discCount = uaCount = 0;
+
+    if (pipe(wakePipe) == -1 || pthread_create(&duplexThread, NULL, duplexReader, NULL) != 0)
+    {
+        perror("duplex");
+        return -1;
+    }
+    printf("Full duplex, acknowledgments delayed up to %d ms\n", ackDelay);
+    return 0;
+}
+
+// Send a framed I-frame until it is acknowledged. The control field is
+// filled in on every (re)transmission, so it carries the latest N(R).
+static int duplexSend(unsigned char *message, int size)
+{
+    int attemptNum = 0;
+    int result = 0;
+
+    pthread_mutex_lock(&senderLock);
+    pthread_mutex_lock(&duplexLock);
+    awaitingAck = TRUE;
+    rejected = FALSE;
+
+    while (awaitingAck)
+    {
+        if (attemptNum > linkLayer.nRetransmissions)
+        {
+            awaitingAck = FALSE;
+            result = -1;
+            break;
+        }
+
+        message[2] = I_DUPLEX(sendSeq, recvSeq) | (message[2] & I_FLAGS);
+        message[3] = BCC(A, message[2]);
+        if (ackPending)
+        {
+            ackPending = FALSE;
+            piggybackSent++;
+        }
+
+        // Until the UA arrives, retransmissions repeat the SET in front of the frame
+        if (uaPending && attemptNum > 0)
+            sendSupervision(setControl);
+        writeFrame(message, size);
+        if (attemptNum > 0)
+            retransmissions++;
+        attemptNum++;
+
+        struct timespec deadline;
+        deadlineAfter(&deadline, linkLayer.timeout * 1000LL);
+        int timedOut = FALSE;
+        while (awaitingAck && !rejected && !timedOut)
+            timedOut = pthread_cond_timedwait(&duplexCond, &duplexLock, &deadline) == ETIMEDOUT;
+
+        if (rejected)
+        {
+            printf("RECEIVED NACK aka RREJ...\n");
+            rejected = FALSE;
+            attemptNum--; // As in half duplex, a REJ does not use up an attempt
+        }
+        else if (awaitingAck)
+            printf("<No answer from receiving end>\n");
+    }
+
+    if (result == 0)
+        framesSent++;
+    pthread_mutex_unlock(&duplexLock);
+    pthread_mutex_unlock(&senderLock);
+    return result;
+}
+
+// Take the next I-frame held by the reader thread and acknowledge it
+static int duplexRead(unsigned char *packet)
+{
+    pthread_mutex_lock(&duplexLock);
+    while (heldSize < 0)
+        pthread_cond_wait(&duplexCond, &duplexLock);
+
+    int size = heldSize;
+    memcpy(packet, held, size);
+    frameControl = heldControl;
+    heldSize = -1;
+    recvSeq = 1 - recvSeq;
+
+    // The acknowledgment rides on the next I-frame if one leaves in time
+    if (ackDelay > 0)
+    {
+        ackPending = TRUE;
+        deadlineAfter(&ackDeadline, ackDelay);
+        wakeReader();
+    }
+    else
+    {
+        sendSupervision(ACK(recvSeq));
+        rrSent++;
+    }
+    pthread_mutex_unlock(&duplexLock);
+    return size;
+}
+
+// Disconnect through the reader thread, then stop it
+static void duplexClose(int statistics)
+{
+    pthread_mutex_lock(&duplexLock);
+    if (ackPending)
+    {
+        sendSupervision(ACK(recvSeq));
+        ackPending = FALSE;
+        rrSent++;
+    }
+
+    // Unlike the half-duplex close, a lost DISC or UA does not hang here: the
+    // transmitter repeats DISC on timeout and the receiver answers each one
+    struct timespec deadline;
+
+    if (linkLayer.role == LlTx)
+    {
+        int attemptNum = 0;
+        while (discCount == 0 && attemptNum++ <= linkLayer.nRetransmissions)
+        {
+            sendSupervision(C_DISC);
+            printf("Sent DISC\n");
+            deadlineAfter(&deadline, linkLayer.timeout * 1000LL);
+            while (discCount == 0 && pthread_cond_timedwait(&duplexCond, &duplexLock, &deadline) != ETIMEDOUT)
+                ;
+        }
+        if (discCount > 0)
+        {
+            printf("Received DISC\n");
+            sendSupervision(C_UA);
+            printf("UA sent\n");
+        }
+    }
+    else
+    {
+        while (discCount == 0)
+            pthread_cond_wait(&duplexCond, &duplexLock);
+        printf("Received DISC\n");
+
+        sendSupervision(C_DISC);
+        printf("Sent DISC to acknowledge\n");
+        int seen = discCount;
+        deadlineAfter(&deadline, (linkLayer.nRetransmissions + 1) * linkLayer.timeout * 1000LL);
+        while (uaCount == 0 && pthread_cond_timedwait(&duplexCond, &duplexLock, &deadline) != ETIMEDOUT)
+        {
+            // A repeated DISC means ours was lost
+            if (discCount != seen)
+            {
+                seen = discCount;
+                sendSupervision(C_DISC);
+            }
+        }
+        if (uaCount > 0)
+            printf("Received UA\n");
+    }
+
+    stopping = TRUE;
+    pthread_mutex_unlock(&duplexLock);
+    wakeReader();
+    pthread_join(duplexThread, NULL);
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+
+    if (statistics)
+    {
+        printf("I-frames: %llu sent, %llu received, %llu retransmissions\n",
+               framesSent, framesReceived, retransmissions);
+        printf("Acknowledgments: %llu as RR, %llu piggybacked sent, %llu piggybacked received\n",
+               rrSent, piggybackSent, piggybackReceived);
+    }
+}
+
 // LLOPEN
 
 // Opens the logical link layer communication.
@@ -133,6 +724,14 @@ int llopen(LinkLayer connectionParameters)
     sigaction(SIGALRM, &action, NULL);
     struct termios newtio;
     linkLayer = connectionParameters;
+    fastOpen = envFlag("LL_FAST_OPEN");
+    linkCompress = FALSE;
+    setControl = envFlag("LL_COMPRESS") ? C | C_NEGOTIATE : C;
+    uaControl = C_UA;
+    duplex = envFlag("LL_DUPLEX");
+    const char *coalesce = getenv("LL_COALESCE");
+    coalesceDelay = (coalesce != NULL) ? atoi(coalesce) : 0;
+    uaPending = FALSE;
 
     // Open the serial port with read/write access
     fd = open(connectionParameters.serialPort, O_RDWR | O_NOCTTY);
@@ -158,9 +757,25 @@ int llopen(LinkLayer connectionParameters)
     newtio.c_cflag = connectionParameters.baudRate | CS8 | CLOCAL | CREAD;
     newtio.c_lflag = 0;
     newtio.c_oflag = 0;
-    newtio.c_cc[VTIME] = 1; // Inter-character timer is not used
-    newtio.c_cc[VMIN] = 0;  // Read blocks until a character arrives
+    newtio.c_cc[VTIME] = 1; // Read returns after 0.1 s without input
+    newtio.c_cc[VMIN] = 0;  // ...or as soon as a character arrives
+
+    const char *profile = getenv("LL_READ_PROFILE");
+    readPoll = FALSE;
+    readChunk = 1;
+    if (profile != NULL && strcmp(profile, "throughput") == 0)
+        readChunk = READ_BUFFER_SIZE;
+    else if (profile != NULL && strcmp(profile, "latency") == 0)
+    {
+        readPoll = TRUE;
+        readChunk = READ_BUFFER_SIZE;
+        newtio.c_cc[VTIME] = 0; // poll() waits, read returns what arrived
+    }
+    else if (profile != NULL)
+        printf("Unknown LL_READ_PROFILE \"%s\", using single-byte reads\n", profile);
+
     tcflush(fd, TCIOFLUSH);
+    readPos = readEnd = 0;
 
     // Apply new settings to the port
     if (tcsetattr(fd, TCSANOW, &newtio) == -1)
@@ -178,12 +793,30 @@ int llopen(LinkLayer connectionParameters)
         unsigned char buf[256] = {0};
         buf[0] = FLAG;
         buf[1] = A;
-        buf[2] = C;
+        buf[2] = setControl;
         buf[3] = BCC(buf[1], buf[2]);
         buf[4] = F;
         hasFailed = 0;
         int bytesNum = 0;
 
+        // In fast-open mode only send SET here, the UA is collected by the first llwrite
+        if (fastOpen)
+        {
+            bytesNum = write(fd, buf, SIZE_SET);
+            printf("Sent SET (fast-open): ");
+            for (int i = 0; i < bytesNum; i++)
+            {
+                printf("%02X ", buf[i]); // Print each element of message as a hexadecimal value
+            }
+            printf("\n");
+            uaPending = TRUE;
+            if (duplex && duplexStart() == -1)
+                return -1;
+            if (coalesceDelay > 0 && coalesceStart() == -1)
+                return -1;
+            return fd;
+        }
+
         // Attempt to send the SET message and wait for UA response
         do
         {
@@ -204,7 +837,7 @@ int llopen(LinkLayer connectionParameters)
 
             while (STOP == FALSE)
             {
-                bytesNum = read(fd, &aux, 1);
+                bytesNum = readByte(&aux);
                 if (bytesNum > 0)
                 {
                     stateDetermine(&state, aux, 1);
@@ -219,7 +852,8 @@ int llopen(LinkLayer connectionParameters)
 
         if (state == DONE)
         {
-            printf("Received UA\n");
+            linkCompress = (frameControl & C_NEGOTIATE) != 0;
+            printf("Received UA%s\n", linkCompress ? ", link compression on" : "");
         }
         else
         {
@@ -236,21 +870,24 @@ int llopen(LinkLayer connectionParameters)
         // Wait for a SET message
         while (STOP == FALSE)
         {
-            read(fd, &aux, 1);
+            readByte(&aux);
             stateDetermine(&state, aux, 0);
 
             if (state == DONE)
                 STOP = TRUE;
         }
 
-        printf("Received SET\n");
+        // Compression is accepted whenever offered, decompressing is cheap
+        linkCompress = (frameControl & C_NEGOTIATE) != 0;
+        uaControl = C_UA | (frameControl & C_NEGOTIATE);
+        printf("Received SET%s\n", linkCompress ? ", link compression on" : "");
 
         // Prepare and send a UA message in response
         unsigned char message[256] = {0};
         message[0] = FLAG;
         message[1] = 0x03;
-        message[2] = 0x07;
-        message[3] = BCC(0x03, 0x07);
+        message[2] = uaControl;
+        message[3] = BCC(0x03, uaControl);
         message[4] = FLAG;
 
         int bytesNum = write(fd, message, SIZE_UA);
@@ -262,6 +899,10 @@ int llopen(LinkLayer connectionParameters)
         printf("\n");
     }
 
+    if (duplex && duplexStart() == -1)
+        return -1;
+    if (coalesceDelay > 0 && coalesceStart() == -1)
+        return -1;
     return fd;
 }
 
@@ -318,6 +959,19 @@ void receiveACK(stateMachine *state, unsigned char byte, unsigned char *ack, int
             *state = C_RCV;
             *ack = NACK(sequenceNum);
         }
+        // In fast-open mode the UA of llopen may still be on its way
+        else if (uaPending && (byte & ~C_NEGOTIATE) == C_UA)
+        {
+            *state = C_RCV;
+            *ack = byte;
+        }
+        // The other end repeats the I-frame llread took last: our RR was lost
+        // and it has not yet seen that the link turned around
+        else if ((byte & ~I_FLAGS) == (1 - expectedNum) << 7)
+        {
+            *state = C_RCV;
+            *ack = byte;
+        }
         // Any other byte, revert to the START state.
         else
         {
@@ -327,9 +981,10 @@ void receiveACK(stateMachine *state, unsigned char byte, unsigned char *ack, int
 
     case C_RCV:
         // If the byte matches the expected BCC value, transition to the BCC_NORMAL state.
+        // The header is all that is needed of a repeated I-frame.
         if (byte == BCC(A, *ack))
         {
-            *state = BCC_NORMAL;
+            *state = IS_I_FRAME(*ack) ? DONE : BCC_NORMAL;
         }
         // If a FLAG is received, reset the acknowledgment and return to the FLAG_RCV state.
         else if (byte == FLAG_RCV)
@@ -364,62 +1019,128 @@ void receiveACK(stateMachine *state, unsigned char byte, unsigned char *ack, int
     }
 }
 
-// Sends a data buffer over the link layer, handles byte stuffing, and acknowledges receipt.
-int llwrite(const unsigned char *buf, int bufSize)
+// Byte-stuff "size" bytes of "src" into "dst", folding them into BCC2.
+// Return the number of bytes written to "dst" (at most 2 * size).
+unsigned int stuffBytes(unsigned char *dst, const unsigned char *src, int size, unsigned char *BCC2)
 {
-    signal(SIGALRM, alarmManager); // Register the alarm signal manager
-    state = START;
-    int attemptNum = 0;         // Counter for retry attempts
+    unsigned int i = 0;
 
-    // Count bytes that need stuffing
-    unsigned int counter = 0;
-    for (int i = 0; i < bufSize; i++)
+    for (int j = 0; j < size; j++)
     {
-        if (buf[i] == FLAG || buf[i] == ESC)
+        *BCC2 = BCC(*BCC2, src[j]);
+        if (src[j] == FLAG || src[j] == ESC)
+        {
+            dst[i++] = ESC;
+            dst[i++] = src[j] ^ 0x20;
+        }
+        else
         {
-            counter++;
+            dst[i++] = src[j];
         }
     }
 
-    unsigned int size = bufSize + 6 + counter; // Calculate total size after stuffing
-    unsigned char message[size];
-    memset(message, 0, size); // Initialize the message buffer
+    return i;
+}
 
+// Frame an I-frame with control field "control" and payload "header"
+// followed by "data" into "message", which holds 2 * payload + 6 bytes.
+// Return the frame size.
+static unsigned int buildIFrame(unsigned char *message, unsigned char control, const unsigned char *header,
+                                int headerSize, const unsigned char *data, int dataSize)
+{
     // Frame header
     message[0] = FLAG;
     message[1] = A;
-    message[2] = sequenceNum << 7;
-    message[3] = BCC(A, sequenceNum << 7);
+    message[2] = control;
+    message[3] = BCC(A, message[2]);
+
+    // Byte stuffing for the payload, BCC2 computed over the unstuffed bytes
+    unsigned char BCC2 = 0;
+    unsigned int size = 4;
+    size += stuffBytes(message + size, header, headerSize, &BCC2);
+    size += stuffBytes(message + size, data, dataSize, &BCC2);
+
+    // Frame footer with BCC2 and FLAG. BCC2 itself is stuffed too, otherwise
+    // a BCC2 of 0x7E ends the frame early
+    unsigned char footerBCC = 0;
+    size += stuffBytes(message + size, &BCC2, 1, &footerBCC);
+    message[size++] = FLAG;
+    return size;
+}
+
+// Shorter payloads are never worth compressing
+#define COMPRESS_MIN_SIZE 32
+
+static unsigned long long linkFrames, linkFramesCompressed, wireBytes, wireBytesRaw;
 
-    unsigned int BCC2 = 0, i = 0;
+// Number of bytes stuffing will escape
+static int escapedBytes(const unsigned char *buf, int size)
+{
+    int count = 0;
+    for (int i = 0; i < size; i++)
+        count += (buf[i] == FLAG || buf[i] == ESC);
+    return count;
+}
+
+// Compress a payload into "packed" if that makes the stuffed frame shorter.
+// Compressed bytes are close to uniform, so about 2 in 256 get escaped,
+// while some raw data (text) has none and some (runs of 0x7E) doubles;
+// counting both sides decides. "rawCost" gets the stuffed raw length and
+// "packedSize" the compressed length. Return TRUE to send it compressed.
+static int compressPayload(const unsigned char *header, int headerSize, const unsigned char *data, int dataSize,
+                           unsigned char *packed, int *packedSize, int *rawCost)
+{
+    int size = headerSize + dataSize;
+    unsigned char raw[MAX_PAYLOAD_SIZE];
+    if (size < COMPRESS_MIN_SIZE || size > MAX_PAYLOAD_SIZE)
+        return FALSE;
+
+    memcpy(raw, header, headerSize);
+    if (dataSize > 0)
+        memcpy(raw + headerSize, data, dataSize);
+
+    *rawCost = size + escapedBytes(raw, size);
+    *packedSize = lzCompress(raw, size, packed);
+    return *packedSize + escapedBytes(packed, *packedSize) < *rawCost;
+}
+
+// Send one I-frame whose payload is "header" followed by "data", with
+// "flags" set in its control field, and wait for its acknowledgment.
+static int sendIFrame(const unsigned char *header, int headerSize, const unsigned char *data, int dataSize,
+                      unsigned char flags)
+{
+    signal(SIGALRM, alarmManager); // Register the alarm signal manager
+    state = START;
+    int attemptNum = 0;         // Counter for retry attempts
 
-    // Byte stuffing for the message
-    for (int j = 0; j < bufSize; j++)
+    unsigned char packed[LZ_BOUND(MAX_PAYLOAD_SIZE)];
+    int packedSize = 0, rawCost = 0;
+    int compressed = linkCompress &&
+                     compressPayload(header, headerSize, data, dataSize, packed, &packedSize, &rawCost);
+    if (compressed)
     {
-        switch (buf[j])
-        {
-        case ESC:
-            message[i + j + 4] = ESC;
-            message[i + j + 5] = ESC ^0x20;
-            BCC2 = BCC(BCC2, ESC);
-            i++;
-            break;
+        header = packed;
+        headerSize = packedSize;
+        data = NULL;
+        dataSize = 0;
+        flags |= C_COMPRESSED;
+    }
 
-        case FLAG:
-            message[i + j + 4] = ESC;
-            message[i + j + 5] = FLAG ^0x20;
-            BCC2 = BCC(BCC2, FLAG);
-            i++;
-            break;
+    // Worst case: every payload byte and BCC2 stuffed
+    unsigned char message[2 * (headerSize + dataSize) + 8];
+    unsigned int size = buildIFrame(message, sequenceNum << 7 | flags, header, headerSize, data, dataSize);
 
-        default:
-            message[i + j + 4] = buf[j];
-            BCC2 = BCC(BCC2, buf[j]);
-        }
+    linkFrames++;
+    wireBytes += size;
+    wireBytesRaw += size;
+    if (compressed)
+    {
+        linkFramesCompressed++;
+        wireBytesRaw += rawCost - packedSize - escapedBytes(packed, packedSize);
     }
 
-    message[i + bufSize + 4] = BCC2; // Frame footer with BCC and FLAG
-    message[i + bufSize + 5] = FLAG;
+    if (duplex)
+        return duplexSend(message, size);
 
     STOP = FALSE;
     alarmOn = FALSE;
@@ -438,7 +1159,14 @@ int llwrite(const unsigned char *buf, int bufSize)
                 return -1; // Max attempts reached
             }
             attemptNum++;
+            retransmissions += (attemptNum > 1);
 
+            // Until the UA arrives, retransmissions repeat the SET in front of the frame
+            if (uaPending && attemptNum > 1)
+            {
+                unsigned char set[] = {FLAG, A, setControl, BCC(A, setControl), F};
+                write(fd, set, SIZE_SET);
+            }
             write(fd, message, size);          // Send the message
             signal(SIGALRM, alarmManager); // Set the alarm signal manager again
             alarm(3);                      // Set an alarm for 3 seconds
@@ -446,15 +1174,34 @@ int llwrite(const unsigned char *buf, int bufSize)
         }
 
         // Read a byte from the link
-        unsigned int bytesNum = read(fd, &receivedByte, 1);
+        unsigned int bytesNum = readByte(&receivedByte);
 
         if (bytesNum > 0)
         {
             receiveACK(&state, receivedByte, &ack, 1 - sequenceNum);
 
+            // Answer a repeated I-frame with its RR again, or both ends would
+            // wait for each other
+            if (state == DONE && IS_I_FRAME(ack))
+            {
+                printf("Repeated message, sending ACK\n");
+                unsigned char ACK_C = ACK(expectedNum);
+                unsigned char buf[] = {FLAG, A, ACK_C, BCC(A, ACK_C), F};
+                write(fd, buf, 5);
+                state = START;
+            }
+            // UA of a fast-open llopen, keep waiting for the RR of the frame
+            else if (state == DONE && (ack & ~C_NEGOTIATE) == C_UA)
+            {
+                linkCompress = (ack & C_NEGOTIATE) != 0;
+                printf("Received UA%s\n", linkCompress ? ", link compression on" : "");
+                uaPending = FALSE;
+                state = START;
+            }
             // Check if the acknowledgment is as expected
-            if (state == DONE && ack == ACK(1 - sequenceNum))
+            else if (state == DONE && ack == ACK(1 - sequenceNum))
             {
+                uaPending = FALSE; // An RR implies the SET was accepted
                 sequenceNum = 1 - sequenceNum;
                 alarm(0);    // Cancel the alarm
                 STOP = TRUE; // Stop the loop
@@ -465,6 +1212,7 @@ int llwrite(const unsigned char *buf, int bufSize)
             {
                 printf("RECEIVED NACK aka RREJ...\n");
                 write(fd, message, size);
+                retransmissions++;
                 state = START;
             }
         }
@@ -472,6 +1220,155 @@ int llwrite(const unsigned char *buf, int bufSize)
     return 0; // Return success
 }
 
+// Coalescing (LL_COALESCE=<ms>): llwrite appends small packets to a pending
+// frame as [length (2 bytes)][packet]. The frame leaves when the next packet
+// does not fit, when the timer thread sees it pending for the delay, or
+// before llread and llclose. llread splits it back into packets.
+
+static pthread_t coalesceThread;
+static pthread_mutex_t coalesceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coalesceCond;
+static unsigned char coalesced[MAX_PAYLOAD_SIZE];
+static int coalescedSize;
+static int coalescedPackets;
+static struct timespec flushDeadline;
+static int coalesceStop;
+static int coalesceError; // A timer flush failed, reported by the next llwrite
+
+static unsigned long long packetsCoalesced, framesCoalesced;
+
+// Send the pending frame. Called with coalesceLock held.
+static int flushCoalesced(void)
+{
+    if (coalescedSize == 0)
+        return 0;
+
+    int result = sendIFrame(coalesced, coalescedSize, NULL, 0, C_COALESCED);
+    packetsCoalesced += coalescedPackets;
+    framesCoalesced++;
+    coalescedSize = 0;
+    coalescedPackets = 0;
+    return result;
+}
+
+// Timer thread: send a pending frame once it waited for the delay
+static void *coalesceTimer(void *arg)
+{
+    pthread_mutex_lock(&coalesceLock);
+    while (!coalesceStop)
+    {
+        if (coalescedSize == 0)
+            pthread_cond_wait(&coalesceCond, &coalesceLock);
+        else if (msUntil(&flushDeadline) == 0)
+        {
+            if (flushCoalesced() == -1)
+                coalesceError = TRUE;
+        }
+        else
+            pthread_cond_timedwait(&coalesceCond, &coalesceLock, &flushDeadline);
+    }
+    pthread_mutex_unlock(&coalesceLock);
+    return NULL;
+}
+
+static int coalesceStart(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&coalesceCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    coalescedSize = coalescedPackets = 0;
+    coalesceStop = coalesceError = FALSE;
+    if (pthread_create(&coalesceThread, NULL, coalesceTimer, NULL) != 0)
+    {
+        perror("coalesce");
+        return -1;
+    }
+    printf("Coalescing small packets, flushed after %d ms\n", coalesceDelay);
+    return 0;
+}
+
+// Send whatever is pending, for llread and llclose
+static int coalesceFlush(void)
+{
+    if (coalesceDelay == 0)
+        return 0;
+
+    pthread_mutex_lock(&coalesceLock);
+    int result = coalesceError ? -1 : flushCoalesced();
+    coalesceError = FALSE;
+    pthread_mutex_unlock(&coalesceLock);
+    return result;
+}
+
+// Flush and stop the timer thread
+static void coalesceClose(void)
+{
+    coalesceFlush();
+    pthread_mutex_lock(&coalesceLock);
+    coalesceStop = TRUE;
+    pthread_cond_signal(&coalesceCond);
+    pthread_mutex_unlock(&coalesceLock);
+    pthread_join(coalesceThread, NULL);
+
+    if (framesCoalesced > 0)
+        printf("Coalescing: %llu packets in %llu frames\n", packetsCoalesced, framesCoalesced);
+}
+
+// Append a packet to the pending frame
+static int coalesceWrite(const unsigned char *header, int headerSize, const unsigned char *data, int dataSize)
+{
+    int size = headerSize + dataSize;
+    pthread_mutex_lock(&coalesceLock);
+    int result = coalesceError ? -1 : 0;
+    coalesceError = FALSE;
+
+    if (result == 0 && coalescedSize + 2 + size > MAX_PAYLOAD_SIZE)
+        result = flushCoalesced();
+
+    // Too big to share a frame, it goes alone, after what was pending
+    if (result == 0 && 2 + size > MAX_PAYLOAD_SIZE)
+        result = sendIFrame(header, headerSize, data, dataSize, 0);
+    else if (result == 0)
+    {
+        if (coalescedSize == 0)
+        {
+            deadlineAfter(&flushDeadline, coalesceDelay);
+            pthread_cond_signal(&coalesceCond);
+        }
+        coalesced[coalescedSize++] = size >> 8;
+        coalesced[coalescedSize++] = size & 0xFF;
+        memcpy(coalesced + coalescedSize, header, headerSize);
+        if (dataSize > 0)
+            memcpy(coalesced + coalescedSize + headerSize, data, dataSize);
+        coalescedSize += size;
+        coalescedPackets++;
+
+        // No room left for even an empty packet
+        if (coalescedSize + 2 >= MAX_PAYLOAD_SIZE)
+            result = flushCoalesced();
+    }
+
+    pthread_mutex_unlock(&coalesceLock);
+    return result;
+}
+
+// Sends a data buffer over the link layer, handles byte stuffing, and acknowledges receipt.
+int llwrite(const unsigned char *buf, int bufSize)
+{
+    return llwritev(buf, bufSize, NULL, 0);
+}
+
+// Like llwrite, for a frame whose payload is "header" followed by "data".
+int llwritev(const unsigned char *header, int headerSize, const unsigned char *data, int dataSize)
+{
+    if (coalesceDelay > 0)
+        return coalesceWrite(header, headerSize, data, dataSize);
+    return sendIFrame(header, headerSize, data, dataSize, 0);
+}
+
 ////////////////////////////////////////////////
 // LLREAD
 ////////////////////////////////////////////////
@@ -482,13 +1379,14 @@ int receiveData(unsigned char *packet, int sequenceNum, size_t *size_read)
     state = START;
     unsigned char REPLY_C = (1 - sequenceNum) << 7;
     unsigned char CONTROL_C = sequenceNum << 7;          // Construct control byte using sequence number
+    frameControl = CONTROL_C;
     unsigned int BCC2 = 0, i = 0, stuffing = 0; // Stuffing flag: set to 1 every time an ESC is encountered
 
     // Keep processing bytes until the end flag is received
     while (state != DONE)
     {
         unsigned char receivedByte;
-        unsigned int bytesNum = read(fd, &receivedByte, 1);
+        unsigned int bytesNum = readByte(&receivedByte);
 
         if (bytesNum > 0)
         {        
@@ -507,15 +1405,21 @@ int receiveData(unsigned char *packet, int sequenceNum, size_t *size_read)
                 {
                     state = FLAG_RCV;
                 }
-                else if (receivedByte == CONTROL_C)
+                else if ((receivedByte & ~I_FLAGS) == CONTROL_C)
                 {
                     state = C_RCV;
+                    frameControl = receivedByte;
                 }
                 // Handling case of receiving repeated message and waiting for the next one
-                else if (REPLY_C == receivedByte)
+                else if (REPLY_C == (receivedByte & ~I_FLAGS))
                 {
                     return REPEATED_MSG_CODE; // Return code indicating a repeated message was received
                 }
+                // A fast-open transmitter repeats SET until it sees our UA
+                else if ((receivedByte & ~C_NEGOTIATE) == C)
+                {
+                    return REPEATED_SET_CODE;
+                }
                 else
                 {
                     state = START;
@@ -542,7 +1446,7 @@ int receiveData(unsigned char *packet, int sequenceNum, size_t *size_read)
                 {
                     state = FLAG_RCV;
                 }
-                else if (receivedByte == BCC(A, CONTROL_C))
+                else if (receivedByte == BCC(A, frameControl))
                 {
                     state = BCC_DATA;
                 }
@@ -594,14 +1498,13 @@ int receiveData(unsigned char *packet, int sequenceNum, size_t *size_read)
 
 
 // Reads data from the link layer and acknowledges the received data.
-int llread(unsigned char *packet)
+static int readIFrame(unsigned char *packet)
 {
     int readStatus;
     size_t size_read;
 
-
     // Continuously try to receive data until successful
-    while ((readStatus = receiveData(packet, sequenceNum, &size_read)) != TRUE)
+    while ((readStatus = receiveData(packet, expectedNum, &size_read)) != TRUE)
     {
         // If the reply indicates an error (e.g., checksum mismatch)
         if (readStatus == 0)
@@ -609,17 +1512,25 @@ int llread(unsigned char *packet)
             printf("Sending RRej or NACK\n");
 
             // Send a NACK (negative acknowledgment)
-            unsigned char NACK_C = NACK(1 - sequenceNum);
+            unsigned char NACK_C = NACK(1 - expectedNum);
             unsigned char buf[] = {FLAG, A, NACK_C, BCC(A, NACK_C), F};
             write(fd, buf, 5);
         }
+        // The transmitter missed our UA, send it again
+        else if (readStatus == REPEATED_SET_CODE)
+        {
+            printf("Repeated SET, sending UA\n");
+
+            unsigned char buf[] = {FLAG, A, uaControl, BCC(A, uaControl), F};
+            write(fd, buf, SIZE_UA);
+        }
         // If the received message is a duplicate (e.g., retransmission)
         else
         {
             printf("Repeated message, sending ACK\n");
 
             // Send an ACK to prevent further retransmissions
-            unsigned char ACK_C = ACK(sequenceNum);
+            unsigned char ACK_C = ACK(expectedNum);
             unsigned char buf[] = {FLAG, A, ACK_C, BCC(A, ACK_C), F};
             write(fd, buf, 5);
         }
@@ -627,14 +1538,75 @@ int llread(unsigned char *packet)
 
     // Once data is received correctly, send an ACK
     printf("Everything in order, sending ACK\n");
-    sequenceNum = 1 - sequenceNum; // Toggle the sequence number
-    unsigned char ACK_C = ACK(sequenceNum);
+    expectedNum = 1 - expectedNum; // Toggle the sequence number
+    unsigned char ACK_C = ACK(expectedNum);
     unsigned char buf[] = {FLAG, A, ACK_C, BCC(A, ACK_C), F};
     write(fd, buf, 5);
 
     return size_read;
 }
 
+// Packets of the last coalesced frame not yet returned by llread
+static unsigned char unpacked[DUPLEX_FRAME_SIZE];
+static int unpackedSize;
+static int unpackedOffset;
+
+// Return the next packet of the last coalesced frame
+static int unpackNext(unsigned char *packet)
+{
+    if (unpackedSize - unpackedOffset < 2)
+    {
+        unpackedOffset = unpackedSize;
+        return -1;
+    }
+
+    int size = unpacked[unpackedOffset] << 8 | unpacked[unpackedOffset + 1];
+    unpackedOffset += 2;
+    if (size > unpackedSize - unpackedOffset)
+    {
+        printf("Malformed coalesced frame\n");
+        unpackedOffset = unpackedSize;
+        return -1;
+    }
+
+    memcpy(packet, unpacked + unpackedOffset, size);
+    unpackedOffset += size;
+    return size;
+}
+
+// Returns the next packet, splitting coalesced frames.
+int llread(unsigned char *packet)
+{
+    if (unpackedOffset < unpackedSize)
+        return unpackNext(packet);
+
+    // In half duplex a reply cannot come before what is still pending here
+    if (coalesceFlush() == -1)
+        return -1;
+
+    int size = duplex ? duplexRead(packet) : readIFrame(packet);
+
+    if (size > 0 && (frameControl & C_COMPRESSED))
+    {
+        unsigned char raw[MAX_PAYLOAD_SIZE];
+        size = lzDecompress(packet, size, raw, sizeof(raw));
+        if (size < 0)
+        {
+            printf("Malformed compressed frame\n");
+            return -1;
+        }
+        memcpy(packet, raw, size);
+    }
+
+    if (size <= 0 || !(frameControl & C_COALESCED))
+        return size;
+
+    memcpy(unpacked, packet, size);
+    unpackedSize = size;
+    unpackedOffset = 0;
+    return unpackNext(packet);
+}
+
 
 ////////////////////////////////////////////////
 // LLCLOSE
@@ -730,7 +1702,19 @@ int llclose(int statistics)
     unsigned char aux = 0;
     unsigned char message[256] = {0};
 
-    switch (linkLayer.role)
+    if (coalesceDelay > 0)
+        coalesceClose();
+
+    if (linkCompress && linkFrames > 0)
+        printf("Link compression: %llu of %llu frames compressed, %llu wire bytes instead of %llu (%.1f%%)\n",
+               linkFramesCompressed, linkFrames, wireBytes, wireBytesRaw, 100.0 * wireBytes / wireBytesRaw);
+
+    if (!duplex && linkFrames > 0)
+        printf("I-frames: %llu sent, %llu retransmissions\n", linkFrames, retransmissions);
+
+    if (duplex)
+        duplexClose(statistics);
+    else switch (linkLayer.role)
     {
     case LlTx:
         // Send DISC (Disconnect Frame)
@@ -752,7 +1736,7 @@ int llclose(int statistics)
         // Wait for DISC acknowledgment
         while (STOP == FALSE)
         {
-            read(fd, &aux, 1);
+            readByte(&aux);
             DISCStateDetermine(&state, aux);
             if (state == DONE)
                 STOP = TRUE;
@@ -782,7 +1766,7 @@ int llclose(int statistics)
         // Wait for DISC from transmitter
         while (STOP == FALSE)
         {
-            read(fd, &aux, 1);
+            readByte(&aux);
             DISCStateDetermine(&state, aux);
 
             if (state == DONE)
@@ -811,7 +1795,7 @@ int llclose(int statistics)
         STOP = FALSE;
         while (STOP == FALSE)
         {
-            read(fd, &aux, 1);
+            readByte(&aux);
             stateDetermine(&state, aux, 1);
 
             if (state == DONE)
@@ -0,0 +1,167 @@
+// LZ4 block format compressor (greedy, single hash table)
+
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define LAST_LITERALS 5  // The block always ends with at least 5 literals
+#define MATCH_LIMIT 12   // No match may start in the last 12 bytes
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static unsigned int hashPosition(const unsigned char *p)
+{
+    return (read32(p) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Write a length that did not fit in its 4-bit token field
+static unsigned char *writeLength(unsigned char *op, int length)
+{
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+// Emit one sequence: literals followed by an optional match
+static unsigned char *writeSequence(unsigned char *op, const unsigned char *literals, int literalLen,
+                                    int offset, int matchLen)
+{
+    unsigned char *token = op++;
+    *token = (literalLen >= 15 ? 15 : literalLen) << 4;
+    if (literalLen >= 15)
+        op = writeLength(op, literalLen - 15);
+    memcpy(op, literals, literalLen);
+    op += literalLen;
+
+    if (matchLen == 0)
+        return op;
+
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    matchLen -= MIN_MATCH;
+    *token |= matchLen >= 15 ? 15 : matchLen;
+    if (matchLen >= 15)
+        op = writeLength(op, matchLen - 15);
+    return op;
+}
+
+int lzCompress(const unsigned char *src, int size, unsigned char *dst)
+{
+    int table[1 << HASH_BITS];
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *end = src + size;
+    unsigned char *op = dst;
+
+    memset(table, -1, sizeof(table));
+
+    if (size > MATCH_LIMIT)
+    {
+        const unsigned char *matchLimit = end - MATCH_LIMIT;
+
+        while (ip < matchLimit)
+        {
+            unsigned int h = hashPosition(ip);
+            int candidate = table[h];
+            table[h] = ip - src;
+
+            if (candidate < 0 || ip - (src + candidate) > MAX_OFFSET ||
+                read32(src + candidate) != read32(ip))
+            {
+                ip++;
+                continue;
+            }
+
+            // Extend the match, stopping before the trailing literals
+            const unsigned char *match = src + candidate;
+            int matchLen = MIN_MATCH;
+            while (ip + matchLen < end - LAST_LITERALS && ip[matchLen] == match[matchLen])
+                matchLen++;
+
+            op = writeSequence(op, anchor, ip - anchor, ip - match, matchLen);
+            ip += matchLen;
+            anchor = ip;
+        }
+    }
+
+    op = writeSequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+int lzDecompress(const unsigned char *src, int size, unsigned char *dst, int capacity)
+{
+    const unsigned char *ip = src;
+    const unsigned char *end = src + size;
+    unsigned char *op = dst;
+    unsigned char *opEnd = dst + capacity;
+
+    while (ip < end)
+    {
+        unsigned char token = *ip++;
+
+        int literalLen = token >> 4;
+        if (literalLen == 15)
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= end)
+                    return -1;
+                b = *ip++;
+                literalLen += b;
+            } while (b == 255);
+        }
+        if (literalLen > end - ip || literalLen > opEnd - op)
+            return -1;
+        memcpy(op, ip, literalLen);
+        op += literalLen;
+        ip += literalLen;
+
+        // The last sequence has no match
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - dst)
+            return -1;
+
+        int matchLen = token & 0x0F;
+        if (matchLen == 15)
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= end)
+                    return -1;
+                b = *ip++;
+                matchLen += b;
+            } while (b == 255);
+        }
+        matchLen += MIN_MATCH;
+        if (matchLen > opEnd - op)
+            return -1;
+
+        // Byte by byte, since the match may overlap the output
+        const unsigned char *match = op - offset;
+        for (int i = 0; i < matchLen; i++)
+            op[i] = match[i];
+        op += matchLen;
+    }
+
+    return op - dst;
+}
@@ -0,0 +1,191 @@
+// Lock-free single-producer single-consumer packet queue implementation
+
+#include "packet_queue.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Spins before a waiting side parks until the next queue change
+#define SPIN_LIMIT 16
+
+// One place for every queue to park at, so the channel scheduler can wait
+// on several queues at once. "changes" counts pushes, pops and closes; the
+// lock and condition variable are only touched when someone is parked.
+static atomic_uint changes;
+static atomic_int parked;
+static pthread_mutex_t parkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parkCond = PTHREAD_COND_INITIALIZER;
+
+// Tell parked waiters that a queue changed
+static void wakeWaiters(void)
+{
+    atomic_fetch_add(&changes, 1);
+    if (atomic_load(&parked) > 0)
+    {
+        pthread_mutex_lock(&parkLock);
+        pthread_cond_broadcast(&parkCond);
+        pthread_mutex_unlock(&parkLock);
+    }
+}
+
+unsigned int packetQueueTicket(void)
+{
+    return atomic_load(&changes);
+}
+
+// Back off while waiting for the other side of the queue
+void packetQueueBackoff(int *spins, unsigned int ticket)
+{
+    if (*spins < SPIN_LIMIT)
+    {
+        (*spins)++;
+        sched_yield();
+        return;
+    }
+
+    // A change made after the ticket was taken, even before parked went up,
+    // shows in "changes", so no wakeup is lost
+    pthread_mutex_lock(&parkLock);
+    atomic_fetch_add(&parked, 1);
+    while (atomic_load(&changes) == ticket)
+        pthread_cond_wait(&parkCond, &parkLock);
+    atomic_fetch_sub(&parked, 1);
+    pthread_mutex_unlock(&parkLock);
+}
+
+uint64_t monotonicNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void packetQueueInit(PacketQueue *q)
+{
+    memset(q->sizes, 0, sizeof(q->sizes));
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->closed, FALSE);
+
+    q->maxDepth = 0;
+    q->depthSum = 0;
+    q->samples = 0;
+    q->producerStalls = 0;
+    q->consumerStalls = 0;
+}
+
+unsigned char *packetQueueReserve(PacketQueue *q)
+{
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    int spins = 0;
+
+    if (tail - atomic_load_explicit(&q->head, memory_order_acquire) == PACKET_QUEUE_DEPTH)
+    {
+        q->producerStalls++;
+        while (1)
+        {
+            unsigned int ticket = packetQueueTicket();
+            if (tail - atomic_load_explicit(&q->head, memory_order_acquire) != PACKET_QUEUE_DEPTH)
+                break;
+            packetQueueBackoff(&spins, ticket);
+        }
+    }
+
+    return q->slots[tail % PACKET_QUEUE_DEPTH];
+}
+
+void packetQueuePush(PacketQueue *q, int size)
+{
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    q->sizes[tail % PACKET_QUEUE_DEPTH] = size;
+    q->stamps[tail % PACKET_QUEUE_DEPTH] = monotonicNs();
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    wakeWaiters();
+
+    int depth = tail + 1 - atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (depth > q->maxDepth)
+        q->maxDepth = depth;
+}
+
+int packetQueueWait(PacketQueue *q, int count)
+{
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    int available = atomic_load_explicit(&q->tail, memory_order_acquire) - head;
+    int spins = 0;
+
+    if (available < count && !packetQueueClosed(q))
+    {
+        if (available == 0)
+            q->consumerStalls++;
+        while (1)
+        {
+            unsigned int ticket = packetQueueTicket();
+            available = atomic_load_explicit(&q->tail, memory_order_acquire) - head;
+            if (available >= count || packetQueueClosed(q))
+                break;
+            packetQueueBackoff(&spins, ticket);
+        }
+    }
+
+    // The producer may have pushed right before closing
+    available = atomic_load_explicit(&q->tail, memory_order_acquire) - head;
+    q->depthSum += available;
+    q->samples++;
+    return available;
+}
+
+unsigned char *packetQueueFront(PacketQueue *q, int *size)
+{
+    if (packetQueueWait(q, 1) == 0)
+        return NULL;
+
+    return packetQueuePeek(q, 0, size);
+}
+
+unsigned char *packetQueuePeek(PacketQueue *q, int index, int *size)
+{
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if ((int)(tail - head) <= index)
+        return NULL;
+
+    unsigned int slot = (head + index) % PACKET_QUEUE_DEPTH;
+    *size = q->sizes[slot];
+    return q->slots[slot];
+}
+
+uint64_t packetQueueStamp(const PacketQueue *q)
+{
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    return q->stamps[head % PACKET_QUEUE_DEPTH];
+}
+
+void packetQueuePop(PacketQueue *q, int count)
+{
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    atomic_store_explicit(&q->head, head + count, memory_order_release);
+    wakeWaiters();
+}
+
+void packetQueueClose(PacketQueue *q)
+{
+    atomic_store_explicit(&q->closed, TRUE, memory_order_release);
+    wakeWaiters();
+}
+
+int packetQueueClosed(PacketQueue *q)
+{
+    return atomic_load_explicit(&q->closed, memory_order_acquire);
+}
+
+void packetQueueStats(const PacketQueue *q, const char *name)
+{
+    printf("%s queue: depth %d, max depth %d, avg depth %.1f, "
+           "producer stalls %llu, consumer stalls %llu\n",
+           name, PACKET_QUEUE_DEPTH, q->maxDepth,
+           q->samples ? (double)q->depthSum / q->samples : 0.0,
+           q->producerStalls, q->consumerStalls);
+}